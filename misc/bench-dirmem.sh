@@ -0,0 +1,48 @@
+#!/bin/sh
+#
+# Report the kernel memory a cached directory listing takes per entry, for
+# directories of 1k, 100k and 1M files (or the COUNTS given).  The
+# directories are made under MOUNTPOINT/bench-dirmem on first use, which
+# takes a while for the large ones.  vfs.vboxfs.dir_maxbufs is set to 0
+# for the run, so that the whole listing stays cached, and the memory is
+# read from the vboxvfs line of vmstat -m while the directory is still
+# the shell's working directory, hence still active.  Remount the share
+# between runs: a listing cached by an earlier run is not counted.
+#
+# usage: bench-dirmem.sh MOUNTPOINT [COUNTS]
+
+if [ $# -lt 1 ]; then
+	echo "usage: $0 MOUNTPOINT [COUNTS]" >&2
+	exit 1
+fi
+BASE=$1/bench-dirmem
+COUNTS=${2:-"1000 100000 1000000"}
+
+# Print the kernel memory in use by vboxvfs, in bytes.
+memuse()
+{
+	vmstat -m | awk '$1 == "vboxvfs" { sub("K$", "", $3); print $3 * 1024 }'
+}
+
+maxbufs=`sysctl -n vfs.vboxfs.dir_maxbufs` || exit 1
+trap 'sysctl vfs.vboxfs.dir_maxbufs=$maxbufs >/dev/null' EXIT
+sysctl vfs.vboxfs.dir_maxbufs=0 >/dev/null || exit 1
+
+for n in $COUNTS; do
+	d=$BASE/$n
+	if [ ! -d "$d" ]; then
+		echo "creating $n files in $d"
+		mkdir -p "$d.tmp" && (cd "$d.tmp" && jot -w f%07d $n |
+		    xargs touch) && mv "$d.tmp" "$d" || exit 1
+	fi
+	(
+		cd "$d" || exit 1
+		b=`memuse`
+		ls -f > /dev/null
+		a=`memuse`
+		echo "$n $b $a" | awk '{
+			printf "%d entries: %d bytes, %.1f bytes/entry\n",
+			    $1, $3 - $2, ($3 - $2) / $1
+		}'
+	) || exit 1
+done
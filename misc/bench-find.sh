@@ -0,0 +1,52 @@
+#!/bin/sh
+#
+# Time "find MOUNTPOINT -type f | wc -l" on a shared folder mounted
+# normally and with -o immutable.  Each mode is mounted afresh; the mount
+# itself is timed too, as an immutable mount lists the whole share there.
+# The first find after the mount is the cold run, the others are warm.
+#
+# usage: bench-find.sh SHARE MOUNTPOINT [RUNS [MOUNT_OPTIONS]]
+
+if [ $# -lt 2 ]; then
+	echo "usage: $0 SHARE MOUNTPOINT [RUNS [MOUNT_OPTIONS]]" >&2
+	exit 1
+fi
+SHARE=$1
+MNT=$2
+RUNS=${3:-3}
+OPTS=${4:+,$4}
+
+# Print the real time "cmd" takes, in seconds.
+elapsed()
+{
+	/usr/bin/time -p sh -c "$1" 2>&1 >/dev/null | awk '/^real/ { print $2 }'
+}
+
+for mode in normal immutable; do
+	umount "$MNT" 2>/dev/null
+	case $mode in
+	normal)		o="ro$OPTS" ;;
+	immutable)	o="ro,immutable$OPTS" ;;
+	esac
+	t=`elapsed "mount_vboxfs -o $o $SHARE $MNT"`
+	if ! mount | grep -q " on $MNT "; then
+		echo "$0: cannot mount $SHARE on $MNT -o $o" >&2
+		exit 1
+	fi
+	files=`find "$MNT" -type f | wc -l`
+	echo "$mode: mount ${t}s, $files files"
+	i=0
+	while [ $i -lt "$RUNS" ]; do
+		# The count above warmed the caches; drop them for run 0.
+		if [ $i -eq 0 ]; then
+			umount "$MNT" && mount_vboxfs -o "$o" "$SHARE" "$MNT" ||
+			    exit 1
+			run=cold
+		else
+			run=warm
+		fi
+		echo "$mode: find $run `elapsed "find $MNT -type f | wc -l"`s"
+		i=$((i + 1))
+	done
+done
+umount "$MNT"
@@ -0,0 +1,45 @@
+#!/bin/sh
+#
+# Measure lookups per second on a mounted shared folder with 1 to MAXPROCS
+# stat(1) processes running at once, making RUNS passes over every file
+# under DIR per process.  The file list is gathered, and the node hash and
+# attribute caches warmed, by a find run before the first measurement.
+#
+# usage: bench-lookup.sh DIR [MAXPROCS [RUNS]]
+
+if [ $# -lt 1 ]; then
+	echo "usage: $0 DIR [MAXPROCS [RUNS]]" >&2
+	exit 1
+fi
+DIR=$1
+MAXPROCS=${2:-`sysctl -n hw.ncpu`}
+RUNS=${3:-3}
+
+LIST=`mktemp -t bench-lookup` || exit 1
+trap 'rm -f "$LIST"' EXIT
+find "$DIR" -type f -print0 > "$LIST"
+files=`tr -cd '\0' < "$LIST" | wc -c`
+if [ "$files" -eq 0 ]; then
+	echo "$0: no files under $DIR" >&2
+	exit 1
+fi
+echo "$files files under $DIR"
+
+# Print the real time "cmd" takes, in seconds.
+elapsed()
+{
+	/usr/bin/time -p sh -c "$1" 2>&1 >/dev/null | awk '/^real/ { print $2 }'
+}
+
+nproc=1
+while [ $nproc -le "$MAXPROCS" ]; do
+	# Every process gets RUNS passes over the list, 1000 files per stat.
+	n=$((nproc * RUNS))
+	t=`elapsed "jot -b '$LIST' $n | xargs cat |
+	    xargs -0 -P $nproc -n 1000 stat -f ''"`
+	echo "$t" | awk -v nproc=$nproc -v n=$((n * files)) '{
+		printf "%d procs: %d lookups in %.2fs, %.0f lookups/s\n",
+		    nproc, n, $1, n / $1
+	}'
+	nproc=$((nproc + 1))
+done
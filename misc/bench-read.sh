@@ -0,0 +1,55 @@
+#!/bin/sh
+#
+# Read FILE, a file on a mounted shared folder, sequentially with dd and
+# report the throughput and how many bounce buffers (vfs.vboxfs.iobuf_hits
+# plus iobuf_misses) each MiB took; reads the host does straight into
+# page lists take none.  The first run follows a remount of the share and
+# is cold, the others are served from the buffer cache.
+#
+# usage: bench-read.sh SHARE MOUNTPOINT FILE [RUNS [BLOCKSIZE]]
+
+if [ $# -lt 3 ]; then
+	echo "usage: $0 SHARE MOUNTPOINT FILE [RUNS [BLOCKSIZE]]" >&2
+	exit 1
+fi
+SHARE=$1
+MNT=$2
+FILE=$3
+RUNS=${4:-3}
+BS=${5:-1m}
+
+# Print the bounce buffers taken so far.
+iobufs()
+{
+	echo $((`sysctl -n vfs.vboxfs.iobuf_hits` + \
+	    `sysctl -n vfs.vboxfs.iobuf_misses`))
+}
+
+umount "$MNT" 2>/dev/null
+mount_vboxfs "$SHARE" "$MNT" || exit 1
+if [ ! -f "$MNT/$FILE" ]; then
+	echo "$0: no file $FILE on $SHARE" >&2
+	umount "$MNT"
+	exit 1
+fi
+size=`stat -f %z "$MNT/$FILE"`
+i=0
+while [ $i -lt "$RUNS" ]; do
+	if [ $i -eq 0 ]; then
+		run=cold
+	else
+		run=warm
+	fi
+	b=`iobufs`
+	out=`dd if="$MNT/$FILE" of=/dev/null bs="$BS" 2>&1`
+	a=`iobufs`
+	echo "$out" | awk -v run=$run -v size=$size -v n=$((a - b)) '
+	    / bytes transferred in / {
+		mib = $1 / 1048576
+		printf "read %s: %.1f MiB in %.3fs, %.1f MiB/s, " \
+		    "%.2f bounce buffers/MiB\n", run, mib, $5, mib / $5,
+		    n * 1048576 / size
+	    }'
+	i=$((i + 1))
+done
+umount "$MNT"
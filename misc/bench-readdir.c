@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2008-2012 Oracle Corporation
+ *
+ * This file is part of VirtualBox Open Source Edition (OSE), as
+ * available from http://www.virtualbox.org. This file is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * General Public License (GPL) as published by the Free Software
+ * Foundation, in version 2 as it comes in the "COPYING" file of the
+ * VirtualBox OSE distribution. VirtualBox OSE is distributed in the
+ * hope that it will be useful, but WITHOUT ANY WARRANTY of any kind.
+ */
+
+/*
+ * Read a directory with getdents(2) and a small buffer, 4 KiB unless
+ * told otherwise, as programs reading huge directories in chunks do, and
+ * report the time the calls took, overall and in each tenth of the
+ * directory.  Were resuming at an offset linear in the offset, the later
+ * tenths would take longer.  bench-dirmem.sh leaves directories of 1k,
+ * 100k and 1M files to read.
+ *
+ * Build with: cc -O2 -o bench-readdir bench-readdir.c
+ *
+ * usage: bench-readdir [-b bufsize] [-r runs] dir
+ */
+
+#include <sys/types.h>
+
+#include <dirent.h>
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define	NSLICES	10
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: bench-readdir [-b bufsize] [-r runs] dir\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	double *t, start, total;
+	char *buf;
+	size_t ncalls, maxcalls, i, j, lo, hi;
+	int bufsize, ch, fd, n, nents, run, runs;
+
+	bufsize = 4096;
+	runs = 3;
+	while ((ch = getopt(argc, argv, "b:r:")) != -1) {
+		switch (ch) {
+		case 'b':
+			bufsize = atoi(optarg);
+			if (bufsize < DIRBLKSIZ)
+				errx(1, "buffer size below %d", DIRBLKSIZ);
+			break;
+		case 'r':
+			runs = atoi(optarg);
+			if (runs < 1)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1)
+		usage();
+
+	if ((buf = malloc(bufsize)) == NULL)
+		err(1, "malloc");
+	maxcalls = 1024;
+	if ((t = malloc(maxcalls * sizeof(*t))) == NULL)
+		err(1, "malloc");
+
+	for (run = 0; run < runs; run++) {
+		if ((fd = open(argv[0], O_RDONLY | O_DIRECTORY)) == -1)
+			err(1, "%s", argv[0]);
+		/* t[i] is the time calls 0 to i took together. */
+		ncalls = 0;
+		nents = 0;
+		total = 0;
+		for (;;) {
+			start = now();
+			n = getdents(fd, buf, bufsize);
+			total += now() - start;
+			if (n == -1)
+				err(1, "getdents");
+			if (n == 0)
+				break;
+			for (i = 0; i < (size_t)n;
+			    i += ((struct dirent *)(buf + i))->d_reclen)
+				nents++;
+			if (ncalls == maxcalls) {
+				maxcalls *= 2;
+				if ((t = realloc(t, maxcalls *
+				    sizeof(*t))) == NULL)
+					err(1, "realloc");
+			}
+			t[ncalls++] = total;
+		}
+		close(fd);
+
+		printf("run %d: %d entries, %zu calls of %d bytes in %.3fs,"
+		    " %.1f us/call\n", run, nents, ncalls, bufsize, total,
+		    ncalls != 0 ? total * 1e6 / ncalls : 0);
+		if (ncalls < NSLICES)
+			continue;
+		printf("  us/call by tenth:");
+		for (j = 0; j < NSLICES; j++) {
+			lo = ncalls * j / NSLICES;
+			hi = ncalls * (j + 1) / NSLICES;
+			printf(" %.1f", (t[hi - 1] -
+			    (lo != 0 ? t[lo - 1] : 0)) * 1e6 / (hi - lo));
+		}
+		printf("\n");
+	}
+	free(t);
+	free(buf);
+	return (0);
+}
@@ -0,0 +1,170 @@
+/*
+ * Copyright (C) 2008-2012 Oracle Corporation
+ *
+ * This file is part of VirtualBox Open Source Edition (OSE), as
+ * available from http://www.virtualbox.org. This file is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * General Public License (GPL) as published by the Free Software
+ * Foundation, in version 2 as it comes in the "COPYING" file of the
+ * VirtualBox OSE distribution. VirtualBox OSE is distributed in the
+ * hope that it will be useful, but WITHOUT ANY WARRANTY of any kind.
+ */
+
+/*
+ * Check mmap and exec on a mounted shared folder, which go through
+ * VOP_GETPAGES and VOP_PUTPAGES.  Those need the kernel's VM and a host,
+ * so unlike vboxvfs/tests this runs in a guest, on a writable directory
+ * of the share.  Its files are removed afterwards.
+ *
+ * Build with: cc -O2 -o check-mmap check-mmap.c
+ *
+ * usage: check-mmap dir
+ *
+ * Output is TAP.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static int ntests, nfailed;
+static size_t pgsz;
+
+static void
+expect(int ok, const char *desc)
+{
+
+	ntests++;
+	if (ok)
+		printf("ok %d - %s\n", ntests, desc);
+	else {
+		printf("not ok %d - %s\n", ntests, desc);
+		nfailed++;
+	}
+}
+
+static void
+fill(char *buf, size_t len, int seed)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = (char)(i * 7 + seed);
+}
+
+/*
+ * Read the file with O_DIRECT, from the host rather than the caches the
+ * mapping shares pages with.
+ */
+static int
+host_read(const char *path, char *buf, size_t len)
+{
+	ssize_t n;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY | O_DIRECT)) == -1)
+		err(1, "%s", path);
+	n = pread(fd, buf, len, 0);
+	close(fd);
+	return (n == (ssize_t)len);
+}
+
+int
+main(int argc, char **argv)
+{
+	char path[PATH_MAX], prog[PATH_MAX];
+	char *want, *got, *p;
+	struct stat sb;
+	size_t len, i;
+	pid_t pid;
+	int fd, fd2, status, ok;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: check-mmap dir\n");
+		return (1);
+	}
+	pgsz = getpagesize();
+	snprintf(path, sizeof(path), "%s/check-mmap.%d", argv[1], getpid());
+	snprintf(prog, sizeof(prog), "%s/check-mmap-ls.%d", argv[1],
+	    getpid());
+	/* Three and a half pages, so the last one is partly past EOF. */
+	len = 3 * pgsz + pgsz / 2;
+	if ((want = malloc(4 * pgsz)) == NULL ||
+	    (got = malloc(4 * pgsz)) == NULL)
+		err(1, "malloc");
+	printf("1..6\n");
+
+	/* Written with write(2), read through a mapping. */
+	fill(want, len, 1);
+	if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1)
+		err(1, "%s", path);
+	if (write(fd, want, len) != (ssize_t)len)
+		err(1, "write");
+	if ((p = mmap(NULL, 4 * pgsz, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+	    0)) == MAP_FAILED)
+		err(1, "mmap");
+	expect(memcmp(p, want, len) == 0, "mapping reads what write wrote");
+	for (ok = 1, i = len; i < 4 * pgsz; i++)
+		ok &= p[i] == 0;
+	expect(ok, "mapping is zero past the end of the file");
+
+	/* Written through the mapping, read from the host. */
+	for (i = 0; i < len; i += pgsz)
+		p[i] = want[i] = ~want[i];
+	expect(msync(p, 4 * pgsz, MS_SYNC) == 0 &&
+	    host_read(path, got, len) && memcmp(got, want, len) == 0,
+	    "msync puts the pages on the host");
+	munmap(p, 4 * pgsz);
+
+	/* Truncated: the mapping follows the new size. */
+	len = pgsz + pgsz / 2;
+	if (ftruncate(fd, len) == -1)
+		err(1, "ftruncate");
+	if ((p = mmap(NULL, 2 * pgsz, PROT_READ, MAP_SHARED, fd, 0)) ==
+	    MAP_FAILED)
+		err(1, "mmap");
+	for (ok = memcmp(p, want, len) == 0, i = len; i < 2 * pgsz; i++)
+		ok &= p[i] == 0;
+	expect(ok, "mapping follows a truncate");
+	munmap(p, 2 * pgsz);
+	close(fd);
+	unlink(path);
+
+	/* Exec maps the binary. */
+	if ((fd = open("/bin/ls", O_RDONLY)) == -1 || fstat(fd, &sb) == -1)
+		err(1, "/bin/ls");
+	if ((fd2 = open(prog, O_WRONLY | O_CREAT | O_TRUNC, 0755)) == -1)
+		err(1, "%s", prog);
+	if ((p = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0)) ==
+	    MAP_FAILED)
+		err(1, "mmap");
+	if (write(fd2, p, sb.st_size) != sb.st_size)
+		err(1, "write");
+	munmap(p, sb.st_size);
+	close(fd2);
+	close(fd);
+	if ((pid = fork()) == -1)
+		err(1, "fork");
+	if (pid == 0) {
+		if ((fd = open("/dev/null", O_WRONLY)) != -1)
+			dup2(fd, STDOUT_FILENO);
+		execl(prog, "ls", argv[1], (char *)NULL);
+		_exit(127);
+	}
+	expect(waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+	    WEXITSTATUS(status) == 0, "binary on the share runs");
+	expect(unlink(prog) == 0, "binary removed after it ran");
+
+	free(got);
+	free(want);
+	return (nfailed != 0);
+}
@@ -55,7 +55,34 @@ static struct mntopt mopts[] = {
 	MOPT_END
 };
 
+/* Options passed through to the vboxfs file system as name=value pairs. */
+static const char *vboxfs_opts[] = {
+	"iosize",
+	"iobufs",
+	"dirttl",
+	"negttl",
+	"acregmin",
+	"acregmax",
+	"acdirmin",
+	"acdirmax",
+	"consistency",
+	"index",
+	"prefetch",
+	"prefetchmax",
+	NULL
+};
+
+/* vboxfs specific options that take no value. */
+static const char *vboxfs_flags[] = {
+	"immutable",
+	"writeback",
+	"nofsync",
+	"casesensitive",
+	NULL
+};
+
 static void usage(void) __dead2;
+static void parse_opts(char *, struct iovec **, int *, int *);
 
 static void 
 usage(void)
@@ -65,10 +92,76 @@ usage(void)
 	    "Mount the VirtualBox shared folder NAME to MOUNTPOINT.\n"
 	    "\nOptions:\n"
 	    "  -w    mount the shared folder writable \n"
-	    "  -r    mount the shared folder read-only (the default)\n");
+	    "  -r    mount the shared folder read-only (the default)\n"
+	    "  -o iosize=BYTES\n"
+	    "        largest single transfer to or from the host\n"
+	    "  -o iobufs=N\n"
+	    "        wired transfer buffers preallocated per CPU\n"
+	    "  -o acregmin=MS,acregmax=MS,acdirmin=MS,acdirmax=MS\n"
+	    "        bounds on the file and directory attribute cache time\n"
+	    "  -o consistency=strict|cto|relaxed\n"
+	    "        when cached attributes are checked against the host\n"
+	    "  -o immutable\n"
+	    "        index the share at mount time, it must not change\n"
+	    "  -o index=FILE\n"
+	    "        immutable, with the index kept in FILE between mounts\n"
+	    "  -o prefetch=LEVELS,prefetchmax=DIRS\n"
+	    "        list the top of the share in the background after mounting\n"
+	    "  -o writeback\n"
+	    "        buffer writes and send them to the host later\n"
+	    "  -o nofsync\n"
+	    "        do not have the host flush files to disk on fsync\n"
+	    "  -o casesensitive\n"
+	    "        the host tells names apart by case\n"
+	    "  -o dirttl=MS\n"
+	    "        time a directory listing is reused unchecked\n"
+	    "  -o negttl=MS\n"
+	    "        time a name not found on the host is remembered\n");
 	exit(1);
 }
 
+/*
+ * Split a -o argument into vboxfs specific options, which are handed to
+ * the kernel as-is, and the standard mount options.
+ */
+static void
+parse_opts(char *optarg, struct iovec **iov, int *iovlen, int *mntflags)
+{
+	char *opt, *val;
+	int i;
+
+	while ((opt = strsep(&optarg, ",")) != NULL) {
+		if (*opt == '\0')
+			continue;
+		val = strchr(opt, '=');
+		if (val != NULL)
+			*val++ = '\0';
+		for (i = 0; vboxfs_opts[i] != NULL; i++)
+			if (strcmp(opt, vboxfs_opts[i]) == 0)
+				break;
+		if (vboxfs_opts[i] != NULL) {
+			if (val == NULL)
+				errx(EX_USAGE, "option %s requires a value",
+				    opt);
+			build_iovec(iov, iovlen, opt, val, (size_t)-1);
+			continue;
+		}
+		for (i = 0; vboxfs_flags[i] != NULL; i++)
+			if (strcmp(opt, vboxfs_flags[i]) == 0)
+				break;
+		if (vboxfs_flags[i] != NULL) {
+			if (val != NULL)
+				errx(EX_USAGE, "option %s takes no value",
+				    opt);
+			build_iovec(iov, iovlen, opt, NULL, 0);
+			continue;
+		}
+		if (val != NULL)
+			val[-1] = '=';
+		getmntopts(opt, mopts, mntflags, 0);
+	}
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -108,7 +201,7 @@ main(int argc, char *argv[])
 			ronly = 0;
 			break;
 		case 'o':
-			getmntopts(optarg, mopts, &mntflags, 0);
+			parse_opts(optarg, &iov, &iovlen, &mntflags);
 			break;
 		}
 
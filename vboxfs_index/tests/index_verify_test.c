@@ -0,0 +1,241 @@
+/*
+ * Copyright (C) 2008-2012 Oracle Corporation
+ *
+ * This file is part of VirtualBox Open Source Edition (OSE), as
+ * available from http://www.virtualbox.org. This file is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * General Public License (GPL) as published by the Free Software
+ * Foundation, in version 2 as it comes in the "COPYING" file of the
+ * VirtualBox OSE distribution. VirtualBox OSE is distributed in the
+ * hope that it will be useful, but WITHOUT ANY WARRANTY of any kind.
+ */
+
+/*
+ * Feed vboxfs_index_verify(), the check the kernel runs on an index file
+ * before loading it, a well formed image and damaged copies of it.  The
+ * image is that of a share holding a/x and b:
+ *
+ *	entry	name	parent	children
+ *	0	""	0	1, 2
+ *	1	a	0	3
+ *	2	b	0
+ *	3	x	1
+ *
+ * Output is TAP.
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/dirent.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vboxvfs_index.h"
+
+#define	NENTS		4
+#define	ENTOFF		roundup2(sizeof(struct vboxfs_index_hdr), 8)
+#define	NAMEOFF		roundup2(ENTOFF + NENTS * sizeof(struct vboxfs_ient), 8)
+#define	IMAGESIZE	(NAMEOFF + 4 + 2 * MAXNAMLEN + 4)
+
+struct image {
+	struct vboxfs_index_hdr	*hdr;
+	struct vboxfs_ient	*ents;
+	char			*names;
+	size_t			len;
+	/* Room for an entry just before the image, see main(). */
+	char			pre[roundup2(sizeof(struct vboxfs_ient), 8)]
+				    __aligned(8);
+	char			buf[IMAGESIZE] __aligned(8);
+};
+
+static int ntests, nfailed;
+
+static void
+add_name(struct image *im, uint32_t e, const char *name, size_t len)
+{
+	struct vboxfs_ient *ie = &im->ents[e];
+
+	ie->ie_name = im->hdr->ih_namelen;
+	ie->ie_namelen = len;
+	memcpy(im->names + ie->ie_name, name, len);
+	im->names[ie->ie_name + len] = '\0';
+	im->hdr->ih_namelen += len + 1;
+}
+
+/*
+ * Lay out the image, with 'xname' ('xlen' bytes) as the name of x.
+ */
+static void
+build(struct image *im, const char *xname, size_t xlen)
+{
+
+	memset(im->buf, 0, sizeof(im->buf));
+	im->hdr = (struct vboxfs_index_hdr *)im->buf;
+	im->ents = (struct vboxfs_ient *)(im->buf + ENTOFF);
+	im->names = im->buf + NAMEOFF;
+
+	im->hdr->ih_magic = VBOXFS_INDEX_MAGIC;
+	im->hdr->ih_version = VBOXFS_INDEX_VERSION;
+	im->hdr->ih_nents = NENTS;
+	im->hdr->ih_entsize = sizeof(struct vboxfs_ient);
+	im->hdr->ih_entoff = ENTOFF;
+	im->hdr->ih_nameoff = NAMEOFF;
+	strlcpy(im->hdr->ih_share, "test0", sizeof(im->hdr->ih_share));
+
+	add_name(im, 0, "", 0);
+	add_name(im, 1, "a", 1);
+	add_name(im, 2, "b", 1);
+	add_name(im, 3, xname, xlen);
+
+	im->ents[0].ie_mode = S_IFDIR | 0755;
+	im->ents[0].ie_flags = VBOXFS_IENT_LISTED;
+	im->ents[0].ie_first = 1;
+	im->ents[0].ie_nchild = 2;
+	im->ents[1].ie_mode = S_IFDIR | 0755;
+	im->ents[1].ie_flags = VBOXFS_IENT_LISTED;
+	im->ents[1].ie_first = 3;
+	im->ents[1].ie_nchild = 1;
+	im->ents[2].ie_mode = S_IFREG | 0644;
+	im->ents[3].ie_mode = S_IFREG | 0644;
+	im->ents[3].ie_parent = 1;
+
+	im->len = NAMEOFF + im->hdr->ih_namelen;
+}
+
+static void
+expect(const struct image *im, int want, const char *desc)
+{
+	int error;
+
+	error = vboxfs_index_verify(im->buf, im->len);
+	ntests++;
+	if (error == want)
+		printf("ok %d - %s\n", ntests, desc);
+	else {
+		printf("not ok %d - %s: got %d, want %d\n", ntests, desc,
+		    error, want);
+		nfailed++;
+	}
+}
+
+int
+main(void)
+{
+	struct image *im;
+	char longname[MAXNAMLEN + 1];
+
+	if ((im = malloc(sizeof(*im))) == NULL)
+		return (1);
+	memset(longname, 'z', sizeof(longname));
+	printf("1..29\n");
+
+	build(im, "x", 1);
+	expect(im, 0, "well formed image");
+	build(im, longname, MAXNAMLEN);
+	expect(im, 0, "name of MAXNAMLEN bytes");
+
+	/* Not an index of this version. */
+	build(im, "x", 1);
+	im->len = sizeof(*im->hdr) - 1;
+	expect(im, EFTYPE, "shorter than the header");
+	build(im, "x", 1);
+	im->hdr->ih_magic++;
+	expect(im, EFTYPE, "bad magic");
+	build(im, "x", 1);
+	im->hdr->ih_version++;
+	expect(im, EFTYPE, "other version");
+	build(im, "x", 1);
+	im->hdr->ih_entsize--;
+	expect(im, EFTYPE, "other entry size");
+
+	/* Header out of bounds. */
+	build(im, "x", 1);
+	im->hdr->ih_nents = 0;
+	expect(im, EINVAL, "no entries");
+	build(im, "x", 1);
+	im->hdr->ih_entoff += 4;
+	expect(im, EINVAL, "misaligned entry array");
+	build(im, "x", 1);
+	im->hdr->ih_nents = 0x10000000;
+	expect(im, EINVAL, "entry array overlaps the name pool");
+	/*
+	 * An entry offset that wraps the end of the address space round to
+	 * a well formed root just before the image.
+	 */
+	build(im, "x", 1);
+	memset(im->pre, 0, sizeof(im->pre));
+	((struct vboxfs_ient *)im->pre)->ie_mode = S_IFDIR | 0755;
+	im->hdr->ih_nents = 1;
+	im->hdr->ih_entoff = -(uint64_t)sizeof(im->pre);
+	expect(im, EINVAL, "entry array offset wrapping around");
+	build(im, "x", 1);
+	im->hdr->ih_entoff = NAMEOFF + 8;
+	expect(im, EINVAL, "entry array after the name pool");
+	build(im, "x", 1);
+	im->len--;
+	expect(im, EINVAL, "name pool past the end of the file");
+	build(im, "x", 1);
+	memset(im->hdr->ih_share, 'x', sizeof(im->hdr->ih_share));
+	expect(im, EINVAL, "share name not terminated");
+	build(im, "x", 1);
+	im->names[im->hdr->ih_namelen - 1] = 'x';
+	expect(im, EINVAL, "name pool not terminated");
+
+	/* Entries. */
+	build(im, "x", 1);
+	im->ents[0].ie_mode = S_IFREG | 0644;
+	expect(im, EINVAL, "root not a directory");
+	build(im, "x", 1);
+	im->ents[3].ie_namelen = 2;
+	expect(im, EINVAL, "name length past its terminator");
+	build(im, "x", 1);
+	im->ents[3].ie_name = im->hdr->ih_namelen;
+	expect(im, EINVAL, "name outside the pool");
+	build(im, "x", 1);
+	im->ents[1].ie_parent = 2;
+	expect(im, EINVAL, "parent after its child");
+
+	/* Names the kernel could not turn into dirents or host paths. */
+	build(im, "", 0);
+	expect(im, EINVAL, "empty name");
+	build(im, longname, MAXNAMLEN + 1);
+	expect(im, EINVAL, "name longer than MAXNAMLEN");
+	build(im, ".", 1);
+	expect(im, EINVAL, "name \".\"");
+	build(im, "..", 2);
+	expect(im, EINVAL, "name \"..\"");
+	build(im, "c/d", 3);
+	expect(im, EINVAL, "name with a slash");
+	build(im, "x", 1);
+	im->ents[1].ie_name = im->ents[0].ie_name;
+	im->ents[1].ie_namelen = 0;
+	expect(im, EINVAL, "empty name of a directory");
+
+	/* Directory listings. */
+	build(im, "x", 1);
+	im->ents[0].ie_first = 0;
+	expect(im, EINVAL, "directory listing itself");
+	build(im, "x", 1);
+	im->ents[1].ie_nchild = 2;
+	expect(im, EINVAL, "children past the entry array");
+	build(im, "x", 1);
+	im->ents[2].ie_flags = VBOXFS_IENT_LISTED;
+	im->ents[2].ie_first = 3;
+	im->ents[2].ie_nchild = 1;
+	expect(im, EINVAL, "file with children");
+	build(im, "x", 1);
+	im->ents[3].ie_parent = 0;
+	expect(im, EINVAL, "child of another parent");
+	build(im, "x", 1);
+	im->ents[1].ie_name = 3;
+	im->ents[2].ie_name = 1;
+	expect(im, EINVAL, "children out of order");
+
+	free(im);
+	return (nfailed != 0);
+}
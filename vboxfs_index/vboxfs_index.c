@@ -0,0 +1,326 @@
+/*
+ * Copyright (C) 2008-2012 Oracle Corporation
+ *
+ * This file is part of VirtualBox Open Source Edition (OSE), as
+ * available from http://www.virtualbox.org. This file is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * General Public License (GPL) as published by the Free Software
+ * Foundation, in version 2 as it comes in the "COPYING" file of the
+ * VirtualBox OSE distribution. VirtualBox OSE is distributed in the
+ * hope that it will be useful, but WITHOUT ANY WARRANTY of any kind.
+ */
+
+/*
+ * Check, print and build the index files of immutable vboxfs mounts, see
+ * vboxvfs_index.c.  The files are checked with the same code the kernel
+ * uses.  Building one from a local directory lays it out as a crawl of a
+ * share with the same contents would, so the loader can be exercised
+ * without a host.
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include "vboxvfs_index.h"
+
+struct index {
+	struct vboxfs_ient	*ents;
+	uint32_t		nents;
+	uint32_t		entsize;
+	char			*names;
+	size_t			namelen;
+	size_t			namesize;
+};
+
+static void usage(void) __dead2;
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+	    "usage: vboxfs_index check FILE\n"
+	    "       vboxfs_index dump FILE\n"
+	    "       vboxfs_index build [-s SHARE] DIRECTORY FILE\n");
+	exit(EX_USAGE);
+}
+
+/*
+ * Read and check index file 'file', and return its image.
+ */
+static char *
+index_read(const char *file)
+{
+	struct stat st;
+	char *image;
+	ssize_t n;
+	int error, fd;
+
+	if ((fd = open(file, O_RDONLY)) == -1)
+		err(EX_NOINPUT, "%s", file);
+	if (fstat(fd, &st) == -1)
+		err(EX_IOERR, "%s", file);
+	if ((image = malloc(st.st_size)) == NULL)
+		err(EX_OSERR, NULL);
+	n = read(fd, image, st.st_size);
+	if (n == -1)
+		err(EX_IOERR, "%s", file);
+	if (n != st.st_size)
+		errx(EX_IOERR, "%s: short read", file);
+	close(fd);
+
+	error = vboxfs_index_verify(image, st.st_size);
+	if (error == EFTYPE)
+		errx(EX_DATAERR, "%s: not a vboxfs index of version %d", file,
+		    VBOXFS_INDEX_VERSION);
+	if (error != 0)
+		errx(EX_DATAERR, "%s: damaged index", file);
+	return (image);
+}
+
+/*
+ * Print the listed part of the tree below entry 'e', whose path is
+ * 'path', depth first.
+ */
+static void
+index_dump(const struct vboxfs_ient *ents, const char *names, uint32_t e,
+    char *path, size_t len)
+{
+	const struct vboxfs_ient *ie = &ents[e];
+	uint32_t c;
+
+	printf("%06o %12ju %19jd %c %s\n", ie->ie_mode,
+	    (uintmax_t)ie->ie_size, (intmax_t)ie->ie_mtime_ns,
+	    (ie->ie_flags & VBOXFS_IENT_LISTED) ? 'L' : '-',
+	    len == 0 ? "/" : path);
+	if ((ie->ie_flags & VBOXFS_IENT_LISTED) == 0)
+		return;
+	for (c = ie->ie_first; c < ie->ie_first + ie->ie_nchild; c++) {
+		if (len + ents[c].ie_namelen + 2 > MAXPATHLEN)
+			errx(EX_DATAERR, "path too long below %s", path);
+		path[len] = '/';
+		memcpy(path + len + 1, names + ents[c].ie_name,
+		    ents[c].ie_namelen + 1);
+		index_dump(ents, names, c, path, len + 1 + ents[c].ie_namelen);
+	}
+	path[len] = '\0';
+}
+
+static uint32_t
+index_add(struct index *ix, uint32_t parent, const char *name, size_t namelen,
+    const struct stat *st)
+{
+	struct vboxfs_ient *ie;
+
+	if (ix->nents == ix->entsize) {
+		ix->entsize = MAX(ix->entsize * 2, 64);
+		ix->ents = reallocf(ix->ents, ix->entsize * sizeof(*ie));
+		if (ix->ents == NULL)
+			err(EX_OSERR, NULL);
+	}
+	while (ix->namelen + namelen + 1 > ix->namesize) {
+		ix->namesize = MAX(ix->namesize * 2, 4096);
+		ix->names = reallocf(ix->names, ix->namesize);
+		if (ix->names == NULL)
+			err(EX_OSERR, NULL);
+	}
+
+	ie = &ix->ents[ix->nents];
+	memset(ie, 0, sizeof(*ie));
+	ie->ie_atime_ns = st->st_atim.tv_sec * 1000000000LL +
+	    st->st_atim.tv_nsec;
+	ie->ie_mtime_ns = st->st_mtim.tv_sec * 1000000000LL +
+	    st->st_mtim.tv_nsec;
+	ie->ie_ctime_ns = st->st_ctim.tv_sec * 1000000000LL +
+	    st->st_ctim.tv_nsec;
+	ie->ie_size = st->st_size;
+	ie->ie_alloc = st->st_blocks * 512;
+	ie->ie_mode = st->st_mode;
+	ie->ie_name = ix->namelen;
+	ie->ie_namelen = namelen;
+	ie->ie_parent = parent;
+	memcpy(ix->names + ix->namelen, name, namelen + 1);
+	ix->namelen += namelen + 1;
+	return (ix->nents++);
+}
+
+static const char *sort_names;
+
+static int
+index_entcmp(const void *a, const void *b)
+{
+	const struct vboxfs_ient *e1 = a, *e2 = b;
+
+	return (vboxfs_index_namecmp(sort_names + e1->ie_name, e1->ie_namelen,
+	    sort_names + e2->ie_name, e2->ie_namelen));
+}
+
+/*
+ * Build the local path of entry 'e' below 'top' in 'buf'.
+ */
+static void
+index_path(const struct index *ix, uint32_t e, const char *top, char *buf)
+{
+	char tmp[MAXPATHLEN];
+	char *p;
+	size_t len;
+
+	p = tmp + sizeof(tmp);
+	*--p = '\0';
+	for (; e != 0; e = ix->ents[e].ie_parent) {
+		len = ix->ents[e].ie_namelen;
+		if ((size_t)(p - tmp) < len + 1)
+			errx(EX_DATAERR, "path too long");
+		p -= len;
+		memcpy(p, ix->names + ix->ents[e].ie_name, len);
+		*--p = '/';
+	}
+	if ((size_t)snprintf(buf, MAXPATHLEN, "%s%s", top, p) >= MAXPATHLEN)
+		errx(EX_DATAERR, "path too long");
+}
+
+/*
+ * Index directory 'top' as the kernel indexes a share: breadth first,
+ * each directory's children sorted by name, every directory listed.
+ */
+static void
+index_build(struct index *ix, const char *top)
+{
+	char path[MAXPATHLEN], child[MAXPATHLEN];
+	struct dirent *dp;
+	struct stat st;
+	DIR *dirp;
+	uint32_t d, first;
+
+	if (lstat(top, &st) == -1)
+		err(EX_NOINPUT, "%s", top);
+	if (!S_ISDIR(st.st_mode))
+		errx(EX_USAGE, "%s: not a directory", top);
+	(void) index_add(ix, 0, "", 0, &st);
+
+	for (d = 0; d < ix->nents; d++) {
+		if (!S_ISDIR(ix->ents[d].ie_mode))
+			continue;
+		index_path(ix, d, top, path);
+		if ((dirp = opendir(path)) == NULL)
+			err(EX_NOINPUT, "%s", path);
+		first = ix->nents;
+		while ((dp = readdir(dirp)) != NULL) {
+			if (strcmp(dp->d_name, ".") == 0 ||
+			    strcmp(dp->d_name, "..") == 0)
+				continue;
+			if ((size_t)snprintf(child, sizeof(child), "%s/%s",
+			    path, dp->d_name) >= sizeof(child))
+				errx(EX_DATAERR, "path too long: %s/%s", path,
+				    dp->d_name);
+			if (lstat(child, &st) == -1)
+				err(EX_NOINPUT, "%s", child);
+			(void) index_add(ix, d, dp->d_name,
+			    strlen(dp->d_name), &st);
+		}
+		closedir(dirp);
+		ix->ents[d].ie_first = first;
+		ix->ents[d].ie_nchild = ix->nents - first;
+		ix->ents[d].ie_flags = VBOXFS_IENT_LISTED;
+		sort_names = ix->names;
+		qsort(&ix->ents[first], ix->nents - first, sizeof(*ix->ents),
+		    index_entcmp);
+	}
+}
+
+static void
+index_write(const struct index *ix, const char *share, const char *file)
+{
+	struct vboxfs_index_hdr ih;
+	char pad[8];
+	FILE *fp;
+
+	memset(&ih, 0, sizeof(ih));
+	ih.ih_magic = VBOXFS_INDEX_MAGIC;
+	ih.ih_version = VBOXFS_INDEX_VERSION;
+	ih.ih_nents = ix->nents;
+	ih.ih_entsize = sizeof(struct vboxfs_ient);
+	ih.ih_entoff = roundup2(sizeof(ih), 8);
+	ih.ih_nameoff = roundup2(ih.ih_entoff +
+	    (uint64_t)ix->nents * sizeof(struct vboxfs_ient), 8);
+	ih.ih_namelen = ix->namelen;
+	if (strlcpy(ih.ih_share, share, sizeof(ih.ih_share)) >=
+	    sizeof(ih.ih_share))
+		errx(EX_USAGE, "share name too long: %s", share);
+
+	memset(pad, 0, sizeof(pad));
+	if ((fp = fopen(file, "w")) == NULL)
+		err(EX_CANTCREAT, "%s", file);
+	if (fwrite(&ih, sizeof(ih), 1, fp) != 1 ||
+	    fwrite(pad, ih.ih_entoff - sizeof(ih), 1, fp) > 1 ||
+	    fwrite(ix->ents, sizeof(struct vboxfs_ient), ix->nents, fp) !=
+	    ix->nents ||
+	    fwrite(pad, ih.ih_nameoff - ih.ih_entoff -
+	    ix->nents * sizeof(struct vboxfs_ient), 1, fp) > 1 ||
+	    fwrite(ix->names, 1, ix->namelen, fp) != ix->namelen ||
+	    fclose(fp) != 0)
+		err(EX_IOERR, "%s", file);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const struct vboxfs_index_hdr *ih;
+	char path[MAXPATHLEN];
+	struct index ix;
+	const char *share;
+	char *image;
+	int ch;
+
+	if (argc < 2)
+		usage();
+
+	if (strcmp(argv[1], "check") == 0) {
+		if (argc != 3)
+			usage();
+		image = index_read(argv[2]);
+		ih = (const struct vboxfs_index_hdr *)image;
+		printf("%s: share %s, %u entries\n", argv[2], ih->ih_share,
+		    ih->ih_nents);
+		free(image);
+	} else if (strcmp(argv[1], "dump") == 0) {
+		if (argc != 3)
+			usage();
+		image = index_read(argv[2]);
+		ih = (const struct vboxfs_index_hdr *)image;
+		path[0] = '\0';
+		index_dump((const struct vboxfs_ient *)(image + ih->ih_entoff),
+		    image + ih->ih_nameoff, 0, path, 0);
+		free(image);
+	} else if (strcmp(argv[1], "build") == 0) {
+		share = "";
+		argc--;
+		argv++;
+		while ((ch = getopt(argc, argv, "s:")) != -1)
+			switch (ch) {
+			case 's':
+				share = optarg;
+				break;
+			default:
+				usage();
+			}
+		if (argc - optind != 2)
+			usage();
+		memset(&ix, 0, sizeof(ix));
+		index_build(&ix, argv[optind]);
+		index_write(&ix, share, argv[optind + 1]);
+	} else
+		usage();
+
+	return (EX_OK);
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2008-2012 Oracle Corporation
+ *
+ * This file is part of VirtualBox Open Source Edition (OSE), as
+ * available from http://www.virtualbox.org. This file is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * General Public License (GPL) as published by the Free Software
+ * Foundation, in version 2 as it comes in the "COPYING" file of the
+ * VirtualBox OSE distribution. VirtualBox OSE is distributed in the
+ * hope that it will be useful, but WITHOUT ANY WARRANTY of any kind.
+ */
+
+/*
+ * Check the read-ahead sizing of the buffer cache read path, see
+ * vboxvfs_ra.h.  The rest of that path, bread and VOP_STRATEGY on host
+ * page lists, needs the kernel and a host.
+ *
+ * Output is TAP.
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "vboxvfs_ra.h"
+
+#define	BSIZE	65536
+
+static int ntests, nfailed;
+
+static void
+expect(long got, long want, const char *desc)
+{
+
+	ntests++;
+	if (got == want)
+		printf("ok %d - %s\n", ntests, desc);
+	else {
+		printf("not ok %d - %s: got %ld, want %ld\n", ntests, desc,
+		    got, want);
+		nfailed++;
+	}
+}
+
+int
+main(void)
+{
+	u_int avg;
+	int i;
+
+	printf("1..14\n");
+
+	/* Running average of the time per block. */
+	expect(vboxfs_ra_avg(0, 800, BSIZE, BSIZE), 100,
+	    "first sample weighs an eighth");
+	expect(vboxfs_ra_avg(800, 800, BSIZE, BSIZE), 800,
+	    "steady samples keep the average");
+	expect(vboxfs_ra_avg(0, 800, BSIZE, 4 * BSIZE), 25,
+	    "time scaled to one block");
+	expect(vboxfs_ra_avg(0, 800, BSIZE, BSIZE / 2), 200,
+	    "short transfer scaled up to one block");
+	avg = 0;
+	for (i = 0; i < 100; i++)
+		avg = vboxfs_ra_avg(avg, 1000, BSIZE, BSIZE);
+	expect(avg >= 993 && avg <= 1000, 1, "average converges");
+	avg = 0;
+	for (i = 0; i < 100; i++)
+		avg = vboxfs_ra_avg(avg, UINT64_MAX / BSIZE, BSIZE, 1);
+	expect(avg <= UINT_MAX / 8 && avg > UINT_MAX / 9, 1,
+	    "huge samples clamped without overflow");
+
+	/* Window. */
+	expect(vboxfs_ra_window(1000, 100, 0, 32), 0, "no run, no window");
+	expect(vboxfs_ra_window(1000, 100, 8, 0), 0,
+	    "read-ahead turned off");
+	expect(vboxfs_ra_window(1000, 100, 32, 32), 10,
+	    "covers one host read at the reader's pace");
+	expect(vboxfs_ra_window(1001, 100, 32, 32), 11, "rounds up");
+	expect(vboxfs_ra_window(1000, 100, 3, 32), 3,
+	    "bounded by the run length");
+	expect(vboxfs_ra_window(1000, 100, 32, 4), 4,
+	    "bounded by the sysctl");
+	expect(vboxfs_ra_window(100, 1000, 32, 32), 1,
+	    "slow reader still gets a block");
+	expect(vboxfs_ra_window(UINT_MAX / 8, 0, 32, 32), 32,
+	    "unknown pace takes the largest window");
+
+	return (nfailed != 0);
+}
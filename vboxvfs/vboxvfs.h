@@ -58,6 +58,25 @@
 #define	VBOXFS_VNODE_DOOMED	4
 #define	VBOXFS_VNODE_WRECLAIM	8
 
+/*
+ * Bounds on the size of a single host read or write.  The actual size is
+ * negotiated at mount time from the host's allocation unit.
+ */
+#define	VBOXFS_DEF_IOSIZE	(1024 * 1024)
+#define	VBOXFS_MAX_IOSIZE	(4 * 1024 * 1024)
+
+/*
+ * Threads serving asynchronous buffer cache reads, see vboxfs_strategy().
+ */
+#define	VBOXFS_RIO_THREADS	4
+
+/*
+ * Consistency with the host across open and close, per mount.
+ */
+#define	VBOXFS_CONS_STRICT	0	/* attributes dropped on every close */
+#define	VBOXFS_CONS_CTO		1	/* attributes refetched on open */
+#define	VBOXFS_CONS_RELAXED	2	/* attribute cache ttl only */
+
 MALLOC_DECLARE(M_VBOXVFS);
 
 #ifdef _KERNEL
@@ -215,20 +234,65 @@ typedef struct sffs_stat {
 /*
  * Read directory entries.
  */
+#define SFFS_DIRENTS_SIZE	8192
+
 /*
- * a singly linked list of buffers, each containing an array of stat's+dirent's.
- * sf_len is length of the sf_entries array, in bytes.
+ * Attributes of a listed entry, packed for the directory listing cache.
+ * Times are in nanoseconds since the epoch.
+ */
+typedef struct sffs_cstat {
+	int64_t		sf_atime_ns;
+	int64_t		sf_mtime_ns;
+	int64_t		sf_ctime_ns;
+	uint64_t	sf_size;
+	uint64_t	sf_alloc;
+	mode_t		sf_mode;
+} sffs_cstat_t;
+
+/*
+ * a singly linked list of buffers.  Each holds sf_nents entries as packed
+ * struct dirent records of their real d_reclen, exactly as getdirentries()
+ * returns them, starting at sf_entries; sf_len is their length in bytes.
+ * The entries' attributes are kept apart, in an array of sffs_cstat_t
+ * growing down from the end of the buffer (see SFFS_DIRENTS_STAT()).
+ *
+ * The directory offset of an entry is the index of its buffer in the
+ * listing times SFFS_DIRENTS_SIZE plus the offset of its record in the
+ * buffer, so readdir finds any offset in constant time.  sf_recmap marks
+ * the 8-byte units of sf_entries where a record starts, to reject offsets
+ * that point into the middle of one.
  */
 typedef struct sffs_dirents {
 	struct sffs_dirents	*sf_next;
 	long long sf_len;
-	struct sffs_dirent {
-		sffs_stat_t	sf_stat;
-		struct dirent	sf_entry;	/* this is variable length */
-		off_t sf_off;
-	} sf_entries[1];
+	int	sf_nents;
+	uint8_t	sf_recmap[SFFS_DIRENTS_SIZE / sizeof(uint64_t) / NBBY];
+	char	sf_entries[] __aligned(sizeof(uint64_t));
 } sffs_dirents_t;
 
+/*
+ * Wired, physically contiguous transfer buffers used by the vnode I/O
+ * and readlink paths.  Each mount keeps a small pool per CPU, sized at
+ * mount time, so the common case never enters the VM to allocate one.
+ */
+struct vboxfs_iobuf {
+	SLIST_ENTRY(vboxfs_iobuf) ib_link;
+	void		*ib_data;
+	size_t		ib_size;
+	int		ib_pooled;	/* belongs to the mount's pool */
+};
+
+struct vboxfs_iopool_cpu {
+	struct mtx	ip_lock;
+	SLIST_HEAD(, vboxfs_iobuf) ip_free;
+} __aligned(CACHE_LINE_SIZE);
+
+struct vboxfs_iopool {
+	struct vboxfs_iopool_cpu *ip_cpu;	/* indexed by cpuid */
+	size_t		ip_bufsize;		/* size of each pool buffer */
+	int		ip_nbufs;		/* buffers allocated in total */
+};
+
 /*
  * Shared Folders filesystem per-mount data structure.
  */
@@ -241,11 +305,35 @@ struct vboxfs_mnt {
 	mode_t		sf_fmode;	/* mode of all files */
 	mode_t		sf_dmask;	/* mask of all directories */
 	mode_t		sf_fmask;	/* mask of all files */
-	int		sf_stat_ttl;	/* ttl for stat caches (in ms) */
+	int		sf_acregmin;	/* file attr cache ttl bounds (in ms) */
+	int		sf_acregmax;
+	int		sf_acdirmin;	/* dir attr cache ttl bounds (in ms) */
+	int		sf_acdirmax;
+	int		sf_dir_ttl;	/* ttl for dir listings (in ms) */
+	int		sf_neg_ttl;	/* ttl for negative lookups (in ms) */
+	int		sf_consistency;	/* VBOXFS_CONS_*, see vboxfs_close() */
+	struct vboxfs_index *sf_index;	/* non NULL if mounted immutable */
+	int		sf_prefetch_depth; /* levels listed at mount, 0: none */
+	u_int		sf_prefetch_max; /* directories listed at mount */
+	struct mtx	sf_prefetch_lock; /* protects sf_prefetch_running */
+	int		sf_prefetch_running;
+	int		sf_prefetch_stop;
+	struct vboxfs_node **sf_prefetch_nodes;	/* held by the crawler */
+	u_int		sf_prefetch_nnodes;
 	int		sf_fsync;	/* whether to honor fsync or not */
-	uint64_t	sf_ino;		/* per FS ino generator */
+	int		sf_writeback;	/* writes are buffered, see vboxfs_write() */
+	int		sf_casesens;	/* names missing from a listing don't exist */
+	uint32_t	sf_iosize;	/* max bytes per host read/write */
+	u_int		sf_bsize;	/* buffer cache block size */
+	u_int		sf_rtt;		/* host read time per block (in us) */
+	struct vboxfs_iopool sf_iopool;	/* per-CPU transfer buffers */
 	uma_zone_t	sf_node_pool;
 	struct vboxfs_node	*sf_root;
+	LIST_HEAD(, vboxfs_node) *sf_hashtbl;	/* nodes by parent + name */
+	u_long		sf_hashmask;
+	LIST_HEAD(, vboxfs_node) *sf_inohashtbl; /* hashed nodes by sf_ino */
+	u_long		sf_inohashmask;
+	struct rwlock	sf_hashlock;	/* protects both hash tables */
 };
 
 /*
@@ -258,19 +346,56 @@ struct vboxfs_mnt {
 struct vboxfs_node {
 	struct vboxfs_mnt	*vboxfsmp;	/* containing mounted file system */
 	char			*sf_path;	/* full pathname to file or dir */
-	uint64_t		sf_ino;		/* assigned unique ID number */
+	SHFLSTRING		*sf_spath;	/* sf_path in host wire format */
+	const char		*sf_name;	/* last component, in sf_path */
+	int			sf_namelen;
+	LIST_ENTRY(vboxfs_node)	sf_hash;	/* link in sf_hashtbl */
+	LIST_ENTRY(vboxfs_node)	sf_inohash;	/* link in sf_inohashtbl */
+	uint32_t		sf_hashval;
+	uint8_t			sf_hashed;	/* on sf_hashtbl */
+	u_int			sf_refcnt;	/* see vboxfs_node_rele() */
+	uint64_t		sf_ino;		/* hash of sf_path, see vboxfs_child_ino() */
+	uint32_t		sf_ient;	/* entry in vboxfsmp->sf_index */
 	struct vnode		*sf_vnode;	/* vnode if active */
 	sfp_file_t		*sf_file;	/* non NULL if open */
 	struct vboxfs_node	*sf_parent;	/* parent sfnode of this one */
-	uint16_t		sf_children;	/* number of children sfnodes */
+	uint32_t		sf_children;	/* entries in sf_dir_index */
 	uint8_t			sf_type;	/* VDIR or VREG */
 	uint8_t			sf_vpstate;	/* XXX: ADD COMMENT */
 	uint8_t			sf_is_stale;	/* this is stale and should be purged */
 	sffs_stat_t		sf_stat;	/* cached file attrs for this node */
 	uint64_t		sf_stat_time;	/* last-modified time of sf_stat */
+	int			sf_stat_ttl;	/* current ttl of sf_stat (in ms) */
 	sffs_dirents_t		*sf_dir_list;	/* list of entries for this directory */
-
-	/* interlock to protect sf_vpstate */
+	sffs_dirents_t		*sf_dir_tail;	/* last buffer of sf_dir_list */
+	sffs_dirents_t		**sf_dir_vec;	/* buffers by index, see below */
+	u_int			sf_dir_nvec;	/* buffers fetched so far */
+	u_int			sf_dir_vecsize;	/* allocated size of sf_dir_vec */
+	u_int			sf_dir_first;	/* first buffer still held */
+	struct sffs_dirstream	*sf_dir_stream;	/* non NULL until listing ends */
+	uint64_t		sf_dir_time;	/* when sf_dir_list was fetched */
+	uint64_t		sf_dir_checked;	/* when it was last revalidated */
+	struct timespec		sf_dir_mtime;	/* dir times at sf_dir_time */
+	struct timespec		sf_dir_ctime;
+	LIST_ENTRY(vboxfs_node)	sf_dir_link;	/* on the listed dirs list */
+	uint8_t			sf_dir_listed;	/* on the listed dirs list */
+	struct sffs_dirslot	*sf_dir_index;	/* names of a complete listing */
+	u_int			sf_dir_indexmask;
+	struct sx		sf_dir_lock;	/* protects sf_dir_* */
+	struct timespec		sf_cache_mtime;	/* host mtime of cached data */
+	off_t			sf_cache_size;	/* host size of cached data */
+	uint8_t			sf_cache_own;	/* host changed by our writes */
+	off_t			sf_wsize;	/* size with writes not yet on host */
+	u_int			sf_rio;		/* async host I/O in flight */
+	uint64_t		sf_wgen;	/* host writes made */
+	uint64_t		sf_sgen;	/* sf_wgen the host has flushed */
+	off_t			sf_ra_next;	/* where a sequential read goes on */
+	ssize_t			sf_ra_len;	/* bytes the last read returned */
+	int			sf_ra_seq;	/* blocks read sequentially */
+	u_int			sf_ra_pace;	/* reader's time per block (in us) */
+	uint64_t		sf_ra_idle;	/* when the last read returned */
+
+	/* interlock to protect sf_vpstate, sf_wgen and stores to sf_stat */
 	struct mtx		sf_interlock;
 };
 
@@ -334,11 +459,33 @@ struct sf_reg_info {
 int vboxfs_alloc_vp(struct mount *, struct vboxfs_node *, int,
     struct vnode **);
 void vboxfs_free_vp(struct vnode *);
+void vfsnode_clear_dir_list(struct vboxfs_node *);
+void vboxfs_dir_lowmem(void *, int);
+
+extern counter_u64_t vboxfs_neg_hits;
+extern counter_u64_t vboxfs_neg_expired;
+extern counter_u64_t vboxfs_prefetch_dirs;
+extern struct taskqueue *vboxfs_rio_tq;
+
+void vboxfs_prefetch_start(struct vboxfs_mnt *);
+void vboxfs_prefetch_stop(struct vboxfs_mnt *);
 
 int vboxfs_alloc_node(struct mount *, struct vboxfs_mnt *, const char*,
     enum vtype, uid_t, gid_t, mode_t, struct vboxfs_node *,
     struct vboxfs_node **);
-void vboxfs_free_node(struct vboxfs_mnt *, struct vboxfs_node *);
+void vboxfs_node_hold(struct vboxfs_node *);
+void vboxfs_node_rele(struct vboxfs_mnt *, struct vboxfs_node *);
+struct vboxfs_node *vboxfs_node_lookup(struct vboxfs_mnt *,
+    struct vboxfs_node *, const char *, int);
+struct vboxfs_node *vboxfs_node_insert(struct vboxfs_mnt *,
+    struct vboxfs_node *);
+void vboxfs_node_unhash(struct vboxfs_mnt *, struct vboxfs_node *);
+ino_t vboxfs_child_ino(struct vboxfs_mnt *, struct vboxfs_node *,
+    const char *, int);
+ino_t vboxfs_path_ino(struct vboxfs_node *, const char *, int);
+
+struct vboxfs_iobuf *vboxfs_iobuf_get(struct vboxfs_mnt *, size_t);
+void vboxfs_iobuf_put(struct vboxfs_mnt *, struct vboxfs_iobuf *);
 
 /*
  * These are the provider interfaces used by sffs to access the underlying
@@ -361,6 +508,19 @@ extern sfp_connection_t *sfprov_connect(int);
 extern void sfprov_disconnect(void);
 
 extern int sfprov_mount(char *, sfp_mount_t **);
+
+/*
+ * Paths are handed to the host as SHFLSTRINGs.  Nodes encode theirs once
+ * with sfprov_string_alloc(); transient paths are built in scratch strings
+ * of MAXPATHLEN bytes taken with sfprov_path_get().
+ */
+#define	SFPROV_STRING_HDR	(offsetof(SHFLSTRING, String))
+
+extern SHFLSTRING *sfprov_string_alloc(const char *, int);
+extern void sfprov_string_free(SHFLSTRING *);
+extern SHFLSTRING *sfprov_path_get(void);
+extern void sfprov_path_put(SHFLSTRING *);
+extern int sfprov_path_child(SHFLSTRING *, SHFLSTRING *, const char *, int);
 extern int sfprov_unmount(sfp_mount_t *);
 
 /*
@@ -377,55 +537,110 @@ typedef struct sffs_fsinfo {
 
 extern int sfprov_get_fsinfo(sfp_mount_t *, sffs_fsinfo_t *);
 
-extern int sfprov_create(sfp_mount_t *, char *path, mode_t mode,
+extern int sfprov_create(sfp_mount_t *, SHFLSTRING *path, mode_t mode,
     sfp_file_t **fp, sffs_stat_t *stat);
-extern int sfprov_open(sfp_mount_t *, char *path, sfp_file_t **fp);
+extern int sfprov_open(sfp_mount_t *, SHFLSTRING *path, sfp_file_t **fp);
+extern int sfprov_opendir(sfp_mount_t *, SHFLSTRING *path, sfp_file_t **fp);
 extern int sfprov_close(sfp_file_t *fp);
 extern int sfprov_read(sfp_file_t *, char * buffer, uint64_t offset,
     uint32_t *numbytes, int buflocked);
+extern int sfprov_can_read_pages(void);
+extern int sfprov_read_pages(sfp_file_t *, uint64_t offset,
+    uint32_t *numbytes, uint16_t pgoff, uint16_t npages, RTGCPHYS64 *pages);
 extern int sfprov_write(sfp_file_t *, char * buffer, uint64_t offset,
     uint32_t *numbytes, int buflocked);
+extern int sfprov_write_pages(sfp_file_t *, uint64_t offset,
+    uint32_t *numbytes, uint16_t pgoff, uint16_t npages, RTGCPHYS64 *pages);
 extern int sfprov_fsync(sfp_file_t *fp);
 
 
 /*
  * get/set information about a file (or directory) using pathname
  */
-extern int sfprov_get_mode(sfp_mount_t *, char *, mode_t *);
-extern int sfprov_get_size(sfp_mount_t *, char *, uint64_t *);
-extern int sfprov_get_atime(sfp_mount_t *, char *, struct timespec *);
-extern int sfprov_get_mtime(sfp_mount_t *, char *, struct timespec *);
-extern int sfprov_get_ctime(sfp_mount_t *, char *, struct timespec *);
-extern int sfprov_get_attr(sfp_mount_t *, char *, sffs_stat_t *);
-extern int sfprov_set_attr(sfp_mount_t *, char *, mode_t,
+extern int sfprov_get_mode(sfp_mount_t *, SHFLSTRING *, mode_t *);
+extern int sfprov_get_size(sfp_mount_t *, SHFLSTRING *, uint64_t *);
+extern int sfprov_get_atime(sfp_mount_t *, SHFLSTRING *, struct timespec *);
+extern int sfprov_get_mtime(sfp_mount_t *, SHFLSTRING *, struct timespec *);
+extern int sfprov_get_ctime(sfp_mount_t *, SHFLSTRING *, struct timespec *);
+extern int sfprov_get_attr(sfp_mount_t *, SHFLSTRING *, sffs_stat_t *);
+extern int sfprov_set_attr(sfp_mount_t *, SHFLSTRING *, mode_t,
    struct timespec, struct timespec, struct timespec);
-extern int sfprov_set_size(sfp_mount_t *, char *, uint64_t);
+extern int sfprov_set_size(sfp_mount_t *, SHFLSTRING *, uint64_t);
 
 
 /*
  * File/Directory operations
  */
-extern int sfprov_trunc(sfp_mount_t *, char *);
-extern int sfprov_remove(sfp_mount_t *, char *path, u_int is_link);
-extern int sfprov_mkdir(sfp_mount_t *, char *path, mode_t mode,
+extern int sfprov_trunc(sfp_mount_t *, SHFLSTRING *);
+extern int sfprov_remove(sfp_mount_t *, SHFLSTRING *path, u_int is_link);
+extern int sfprov_mkdir(sfp_mount_t *, SHFLSTRING *path, mode_t mode,
     sfp_file_t **fp, sffs_stat_t *stat);
-extern int sfprov_rmdir(sfp_mount_t *, char *path);
-extern int sfprov_rename(sfp_mount_t *, char *from, char *to, u_int is_dir);
+extern int sfprov_rmdir(sfp_mount_t *, SHFLSTRING *path);
+extern int sfprov_rename(sfp_mount_t *, SHFLSTRING *from,
+    SHFLSTRING *to, u_int is_dir);
 
 
 /*
  * Symbolic link operations
  */
 extern int sfprov_set_show_symlinks(void);
-extern int sfprov_readlink(sfp_mount_t *, char *path, char *target,
+extern int sfprov_readlink(sfp_mount_t *, SHFLSTRING *path, char *target,
     size_t tgt_size);
-extern int sfprov_symlink(sfp_mount_t *, char *linkname, char *target,
+extern int sfprov_symlink(sfp_mount_t *, SHFLSTRING *linkname, char *target,
     sffs_stat_t *stat);
 
-#define SFFS_DIRENTS_SIZE	8192
 #define SFFS_DIRENTS_OFF	(offsetof(sffs_dirents_t, sf_entries[0]))
+#define SFFS_DIRENTS_STAT(buf, i)	\
+	((sffs_cstat_t *)((char *)(buf) + SFFS_DIRENTS_SIZE) - 1 - (i))
+
+extern int sfprov_readdir(sfp_mount_t *mnt, SHFLSTRING *path,
+    sffs_dirents_t **dirents);
+
+#define SFFS_DIRINFO_SIZE	16384	/* host batch buffer per stream */
 
-extern int sfprov_readdir(sfp_mount_t *mnt, char *path,
+struct sffs_dirstream {
+	sfp_file_t	*ds_fp;		/* open directory */
+	SHFLSTRING	*ds_mask;	/* "path/*" */
+	SHFLDIRINFO	*ds_info;	/* host batch buffer */
+	uint32_t	ds_infolen;
+	int		ds_eof;		/* host reported no more files */
+	int		ds_own_fp;	/* ds_fp opened by the stream */
+	uint32_t	ds_flags;	/* SHFL_LIST_* for the next request */
+};
+typedef struct sffs_dirstream sffs_dirstream_t;
+
+/*
+ * Slot of a directory's name index: the hash of an entry's name, its
+ * record number within its buffer and its readdir cookie plus one, 0
+ * marking a free slot.
+ */
+struct sffs_dirslot {
+	uint32_t	ds_hash;
+	uint32_t	ds_rec;
+	off_t		ds_cookie;
+};
+
+extern int sfprov_readdir_open(sfp_mount_t *mnt, SHFLSTRING *path,
+    sfp_file_t *fp, sffs_dirstream_t **dsp);
+extern int sfprov_readdir_next(sffs_dirstream_t *ds,
+    sffs_dirents_t **dirents);
+extern void sfprov_readdir_close(sffs_dirstream_t *ds);
+extern void sfprov_stat_from_cstat(sffs_stat_t *stat, const sffs_cstat_t *cs);
+
+/*
+ * Metadata index of an immutable mount, see vboxvfs_index.c.
+ */
+struct vboxfs_index;
+
+extern int vboxfs_index_build(sfp_mount_t *mnt, const char *share,
+    const char *file, struct vboxfs_index **ixp);
+extern int vboxfs_index_save(struct vboxfs_index *ix);
+extern void vboxfs_index_free(struct vboxfs_index *ix);
+extern int vboxfs_index_lookup(struct vboxfs_index *ix, uint32_t dir,
+    const char *name, int namelen, uint32_t *entp, sffs_stat_t *stat);
+extern int vboxfs_index_stat(struct vboxfs_index *ix, uint32_t e,
+    sffs_stat_t *stat);
+extern int vboxfs_index_readdir(struct vboxfs_index *ix, uint32_t dir,
     sffs_dirents_t **dirents);
 
 #endif  /* KERNEL */
@@ -0,0 +1,665 @@
+/*
+ * Copyright (C) 2008-2012 Oracle Corporation
+ *
+ * This file is part of VirtualBox Open Source Edition (OSE), as
+ * available from http://www.virtualbox.org. This file is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * General Public License (GPL) as published by the Free Software
+ * Foundation, in version 2 as it comes in the "COPYING" file of the
+ * VirtualBox OSE distribution. VirtualBox OSE is distributed in the
+ * hope that it will be useful, but WITHOUT ANY WARRANTY of any kind.
+ */
+
+/*
+ * Metadata index of an immutable mount.
+ *
+ * A share mounted with the immutable option is crawled once, at mount
+ * time, and the name and attributes of everything in it are kept here.
+ * Lookups, attributes and directory listings are then answered from the
+ * index without asking the host.  The share must not change while it is
+ * mounted this way; nothing notices if it does.
+ *
+ * The entries are kept in a single array, filled breadth first, so that
+ * the children of a directory are contiguous.  They are sorted by name
+ * for lookups.  The names themselves are kept in one string pool.  The
+ * layout is that of the index file, see vboxvfs_index.h.
+ *
+ * With the index mount option the index is kept in a file on the guest
+ * between mounts.  A mount that finds the file loads it instead of
+ * crawling, and checks each entry against the host the first time it is
+ * used: its attributes are fetched again and, for a directory whose
+ * times have changed since, so is its listing.  The new children are
+ * appended to the array; the old ones stay behind, unreferenced, until
+ * the file is next written.  A warm mount so only costs host calls for
+ * the part of the share that is used.  The file is written after a crawl
+ * and, if a directory was listed again, at unmount.
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/kernel.h>
+#include <sys/malloc.h>
+#include <sys/stat.h>
+#include <sys/dirent.h>
+#include <sys/fcntl.h>
+#include <sys/libkern.h>
+#include <sys/lock.h>
+#include <sys/namei.h>
+#include <sys/proc.h>
+#include <sys/sx.h>
+#include <sys/vnode.h>
+
+#include "vboxvfs.h"
+#include "vboxvfs_index.h"
+
+/* Largest index file that is loaded. */
+#define	VBOXFS_INDEX_MAXFILE	(1024 * 1024 * 1024)
+
+struct vboxfs_index {
+	struct sx		ix_lock;	/* protects the arrays */
+	sfp_mount_t		*ix_mnt;
+	struct vboxfs_ient	*ix_ents;
+	uint32_t		ix_nents;
+	uint32_t		ix_entsize;
+	char			*ix_names;
+	size_t			ix_namelen;
+	size_t			ix_namesize;
+	char			*ix_file;	/* index file, or NULL */
+	int			ix_dirty;	/* the file is out of date */
+	char			ix_share[VBOXFS_INDEX_SHARELEN];
+};
+
+#define	IX_NAME(ix, e)	((ix)->ix_names + (ix)->ix_ents[e].ie_name)
+
+/* The entry, and the children of a directory, match the host. */
+#define	IX_READY(ie)							\
+	(((ie)->ie_flags & VBOXFS_IENT_CHECKED) != 0 &&			\
+	(!S_ISDIR((ie)->ie_mode) || ((ie)->ie_flags & VBOXFS_IENT_LISTED) != 0))
+
+/*
+ * Grow 'buf' of '*sizep' bytes to hold at least 'need', doubling.
+ */
+static void *
+vboxfs_index_grow(void *buf, size_t used, size_t *sizep, size_t need)
+{
+	void *nbuf;
+	size_t size;
+
+	if (need <= *sizep)
+		return (buf);
+	for (size = MAX(*sizep, 4096); size < need; size *= 2)
+		;
+	nbuf = malloc(size, M_VBOXVFS, M_WAITOK);
+	if (buf != NULL) {
+		memcpy(nbuf, buf, used);
+		free(buf, M_VBOXVFS);
+	}
+	*sizep = size;
+	return (nbuf);
+}
+
+static uint32_t
+vboxfs_index_add(struct vboxfs_index *ix, uint32_t parent, const char *name,
+    int namelen)
+{
+	struct vboxfs_ient *ie;
+	size_t size;
+
+	size = ix->ix_entsize * sizeof(*ie);
+	ix->ix_ents = vboxfs_index_grow(ix->ix_ents,
+	    ix->ix_nents * sizeof(*ie), &size, (ix->ix_nents + 1) * sizeof(*ie));
+	ix->ix_entsize = size / sizeof(*ie);
+	ix->ix_names = vboxfs_index_grow(ix->ix_names, ix->ix_namelen,
+	    &ix->ix_namesize, ix->ix_namelen + namelen + 1);
+
+	ie = &ix->ix_ents[ix->ix_nents];
+	bzero(ie, sizeof(*ie));
+	ie->ie_name = ix->ix_namelen;
+	ie->ie_namelen = namelen;
+	ie->ie_parent = parent;
+	memcpy(ix->ix_names + ix->ix_namelen, name, namelen);
+	ix->ix_names[ix->ix_namelen + namelen] = '\0';
+	ix->ix_namelen += namelen + 1;
+	return (ix->ix_nents++);
+}
+
+static int
+vboxfs_index_entcmp(void *arg, const void *a, const void *b)
+{
+	struct vboxfs_index *ix = arg;
+	const struct vboxfs_ient *e1 = a, *e2 = b;
+
+	return (vboxfs_index_namecmp(ix->ix_names + e1->ie_name,
+	    e1->ie_namelen, ix->ix_names + e2->ie_name, e2->ie_namelen));
+}
+
+/*
+ * Build the host path of entry 'e', other than the root, in 'path'.
+ * 'buf' is MAXPATHLEN bytes of scratch space, 'root' the (empty) path of
+ * the share root.
+ */
+static int
+vboxfs_index_path(struct vboxfs_index *ix, uint32_t e, char *buf,
+    SHFLSTRING *root, SHFLSTRING *path)
+{
+	char *p;
+	int len;
+
+	p = buf + MAXPATHLEN;
+	for (; e != 0; e = ix->ix_ents[e].ie_parent) {
+		len = ix->ix_ents[e].ie_namelen;
+		if (p - buf < len + 1)
+			return (ENAMETOOLONG);
+		p -= len;
+		memcpy(p, IX_NAME(ix, e), len);
+		*--p = '/';
+	}
+	/* sfprov_path_child() puts the leading '/' back. */
+	return (sfprov_path_child(path, root, p + 1,
+	    buf + MAXPATHLEN - p - 1));
+}
+
+static void
+vboxfs_index_to_cstat(sffs_cstat_t *cs, const struct vboxfs_ient *ie)
+{
+	cs->sf_mode = ie->ie_mode;
+	cs->sf_size = ie->ie_size;
+	cs->sf_alloc = ie->ie_alloc;
+	cs->sf_atime_ns = ie->ie_atime_ns;
+	cs->sf_mtime_ns = ie->ie_mtime_ns;
+	cs->sf_ctime_ns = ie->ie_ctime_ns;
+}
+
+static void
+vboxfs_index_from_cstat(struct vboxfs_ient *ie, const sffs_cstat_t *cs)
+{
+	ie->ie_mode = cs->sf_mode;
+	ie->ie_size = cs->sf_size;
+	ie->ie_alloc = cs->sf_alloc;
+	ie->ie_atime_ns = cs->sf_atime_ns;
+	ie->ie_mtime_ns = cs->sf_mtime_ns;
+	ie->ie_ctime_ns = cs->sf_ctime_ns;
+}
+
+static void
+vboxfs_index_from_stat(struct vboxfs_ient *ie, const sffs_stat_t *stat)
+{
+	ie->ie_mode = stat->sf_mode;
+	ie->ie_size = stat->sf_size;
+	ie->ie_alloc = stat->sf_alloc;
+	ie->ie_atime_ns = stat->sf_atime.tv_sec * 1000000000LL +
+	    stat->sf_atime.tv_nsec;
+	ie->ie_mtime_ns = stat->sf_mtime.tv_sec * 1000000000LL +
+	    stat->sf_mtime.tv_nsec;
+	ie->ie_ctime_ns = stat->sf_ctime.tv_sec * 1000000000LL +
+	    stat->sf_ctime.tv_nsec;
+}
+
+/*
+ * List directory entry 'd' and append its children, sorted by name.
+ * Their attributes come with the listing, so they are checked already.
+ */
+static int
+vboxfs_index_list(struct vboxfs_index *ix, uint32_t d, SHFLSTRING *path)
+{
+	sffs_dirents_t *list, *cur_buf;
+	struct dirent *dirent;
+	uint32_t e, first;
+	int error, i;
+
+	error = sfprov_readdir(ix->ix_mnt, path, &list);
+	if (error != 0)
+		return (error);
+
+	first = ix->ix_nents;
+	while ((cur_buf = list) != NULL) {
+		dirent = (struct dirent *)&cur_buf->sf_entries[0];
+		for (i = 0; i < cur_buf->sf_nents; i++,
+		    dirent = (struct dirent *)
+		    ((char *)dirent + dirent->d_reclen)) {
+			if (strcmp(dirent->d_name, ".") == 0 ||
+			    strcmp(dirent->d_name, "..") == 0)
+				continue;
+			e = vboxfs_index_add(ix, d, dirent->d_name,
+			    dirent->d_namlen);
+			vboxfs_index_from_cstat(&ix->ix_ents[e],
+			    SFFS_DIRENTS_STAT(cur_buf, i));
+			ix->ix_ents[e].ie_flags = VBOXFS_IENT_CHECKED;
+		}
+		list = cur_buf->sf_next;
+		free(cur_buf, M_VBOXVFS);
+	}
+	ix->ix_ents[d].ie_first = first;
+	ix->ix_ents[d].ie_nchild = ix->ix_nents - first;
+	ix->ix_ents[d].ie_flags |= VBOXFS_IENT_LISTED;
+	qsort_r(&ix->ix_ents[first], ix->ix_nents - first,
+	    sizeof(struct vboxfs_ient), ix, vboxfs_index_entcmp);
+	return (0);
+}
+
+/*
+ * Bring entry 'e' up to date with the host: fetch its attributes unless
+ * they came with its directory's listing, and list a directory that is
+ * new or whose times changed.
+ */
+static int
+vboxfs_index_check(struct vboxfs_index *ix, uint32_t e)
+{
+	struct vboxfs_ient *ie;
+	SHFLSTRING *root, *path;
+	sffs_stat_t stat;
+	int64_t mtime, ctime;
+	char *buf;
+	int error;
+
+	sx_assert(&ix->ix_lock, SA_XLOCKED);
+	ie = &ix->ix_ents[e];
+	if (IX_READY(ie))
+		return (0);
+
+	root = sfprov_string_alloc("", 0);
+	path = sfprov_path_get();
+	buf = malloc(MAXPATHLEN, M_VBOXVFS, M_WAITOK);
+	error = (e == 0) ? 0 : vboxfs_index_path(ix, e, buf, root, path);
+	if (error != 0)
+		goto out;
+	if ((ie->ie_flags & VBOXFS_IENT_CHECKED) == 0) {
+		error = sfprov_get_attr(ix->ix_mnt, (e == 0) ? root : path,
+		    &stat);
+		if (error != 0)
+			goto out;
+		mtime = ie->ie_mtime_ns;
+		ctime = ie->ie_ctime_ns;
+		vboxfs_index_from_stat(ie, &stat);
+		if (!S_ISDIR(ie->ie_mode) || ie->ie_mtime_ns != mtime ||
+		    ie->ie_ctime_ns != ctime) {
+			ie->ie_flags &= ~VBOXFS_IENT_LISTED;
+			ie->ie_nchild = 0;
+		}
+		ie->ie_flags |= VBOXFS_IENT_CHECKED;
+	}
+	if (S_ISDIR(ie->ie_mode) && (ie->ie_flags & VBOXFS_IENT_LISTED) == 0) {
+		error = vboxfs_index_list(ix, e, (e == 0) ? root : path);
+		ix->ix_dirty = 1;
+	}
+out:
+	free(buf, M_VBOXVFS);
+	sfprov_path_put(path);
+	sfprov_string_free(root);
+	return (error);
+}
+
+/*
+ * Share lock the index with entry 'e' up to date.
+ */
+static int
+vboxfs_index_slock(struct vboxfs_index *ix, uint32_t e)
+{
+	int error;
+
+	sx_slock(&ix->ix_lock);
+	if (IX_READY(&ix->ix_ents[e]))
+		return (0);
+	sx_sunlock(&ix->ix_lock);
+	sx_xlock(&ix->ix_lock);
+	error = vboxfs_index_check(ix, e);
+	if (error != 0) {
+		sx_xunlock(&ix->ix_lock);
+		return (error);
+	}
+	sx_downgrade(&ix->ix_lock);
+	return (0);
+}
+
+/*
+ * Lay the index out as an index file, in a buffer of '*lenp' bytes.
+ * Only the entries reachable from the root are kept, breadth first as a
+ * crawl leaves them, and none is marked checked.
+ */
+static char *
+vboxfs_index_image(struct vboxfs_index *ix, size_t *lenp)
+{
+	struct vboxfs_index_hdr *ih;
+	struct vboxfs_ient *ents, *ie, *oie;
+	uint32_t *from, nents, e, c;
+	size_t namelen;
+	char *image, *names;
+
+	sx_assert(&ix->ix_lock, SA_LOCKED);
+	*lenp = roundup2(sizeof(*ih), 8) + ix->ix_nents * sizeof(*ents) +
+	    ix->ix_namelen;
+	image = malloc(*lenp, M_VBOXVFS, M_WAITOK | M_ZERO);
+	ih = (struct vboxfs_index_hdr *)image;
+	ents = (struct vboxfs_ient *)(image + roundup2(sizeof(*ih), 8));
+	from = malloc(ix->ix_nents * sizeof(*from), M_VBOXVFS, M_WAITOK);
+
+	ents[0] = ix->ix_ents[0];
+	from[0] = 0;
+	nents = 1;
+	for (e = 0; e < nents; e++) {
+		ie = &ents[e];
+		oie = &ix->ix_ents[from[e]];
+		ie->ie_flags &= VBOXFS_IENT_LISTED;
+		if ((ie->ie_flags & VBOXFS_IENT_LISTED) == 0) {
+			ie->ie_first = ie->ie_nchild = 0;
+			continue;
+		}
+		ie->ie_first = nents;
+		for (c = oie->ie_first; c < oie->ie_first + oie->ie_nchild;
+		    c++) {
+			ents[nents] = ix->ix_ents[c];
+			ents[nents].ie_parent = e;
+			from[nents++] = c;
+		}
+	}
+
+	/* The name pool goes after the entries that are kept. */
+	names = (char *)(ents + nents);
+	namelen = 0;
+	for (e = 0; e < nents; e++) {
+		memcpy(names + namelen, IX_NAME(ix, from[e]),
+		    ents[e].ie_namelen + 1);
+		ents[e].ie_name = namelen;
+		namelen += ents[e].ie_namelen + 1;
+	}
+	free(from, M_VBOXVFS);
+
+	ih->ih_magic = VBOXFS_INDEX_MAGIC;
+	ih->ih_version = VBOXFS_INDEX_VERSION;
+	ih->ih_nents = nents;
+	ih->ih_entsize = sizeof(*ents);
+	ih->ih_entoff = (char *)ents - image;
+	ih->ih_nameoff = names - image;
+	ih->ih_namelen = namelen;
+	strlcpy(ih->ih_share, ix->ix_share, sizeof(ih->ih_share));
+	*lenp = ih->ih_nameoff + namelen;
+	return (image);
+}
+
+/*
+ * Write the index file.
+ */
+int
+vboxfs_index_save(struct vboxfs_index *ix)
+{
+	struct thread *td = curthread;
+	struct nameidata nd;
+	struct vnode *vp;
+	char *image;
+	size_t len;
+	int error, flags;
+
+	if (ix->ix_file == NULL)
+		return (0);
+	sx_slock(&ix->ix_lock);
+	image = vboxfs_index_image(ix, &len);
+	sx_sunlock(&ix->ix_lock);
+
+	NDINIT(&nd, LOOKUP, NOFOLLOW, UIO_SYSSPACE, ix->ix_file, td);
+	flags = FWRITE | O_CREAT | O_TRUNC | O_NOFOLLOW;
+	error = vn_open(&nd, &flags, S_IRUSR | S_IWUSR, NULL);
+	if (error == 0) {
+		NDFREE(&nd, NDF_ONLY_PNBUF);
+		vp = nd.ni_vp;
+		error = vn_rdwr(UIO_WRITE, vp, image, len, 0, UIO_SYSSPACE,
+		    IO_NODELOCKED | IO_SYNC, td->td_ucred, NOCRED, NULL, td);
+		VOP_UNLOCK(vp, 0);
+		vn_close(vp, FWRITE, td->td_ucred, td);
+	}
+	free(image, M_VBOXVFS);
+	if (error == 0)
+		ix->ix_dirty = 0;
+	else
+		printf("vboxvfs: cannot write index %s: error %d\n",
+		    ix->ix_file, error);
+	return (error);
+}
+
+/*
+ * Read the index file, if it is one and was made for this share.
+ */
+static int
+vboxfs_index_load(struct vboxfs_index *ix)
+{
+	struct thread *td = curthread;
+	struct vboxfs_index_hdr *ih;
+	struct nameidata nd;
+	struct vnode *vp;
+	struct vattr va;
+	ssize_t resid;
+	char *image;
+	int error, flags;
+
+	NDINIT(&nd, LOOKUP, FOLLOW, UIO_SYSSPACE, ix->ix_file, td);
+	flags = FREAD;
+	error = vn_open(&nd, &flags, 0, NULL);
+	if (error != 0)
+		return (error);
+	NDFREE(&nd, NDF_ONLY_PNBUF);
+	vp = nd.ni_vp;
+	image = NULL;
+	error = VOP_GETATTR(vp, &va, td->td_ucred);
+	if (error == 0 && (vp->v_type != VREG ||
+	    va.va_size > VBOXFS_INDEX_MAXFILE))
+		error = EFTYPE;
+	if (error == 0) {
+		image = malloc(va.va_size, M_VBOXVFS, M_WAITOK);
+		error = vn_rdwr(UIO_READ, vp, image, va.va_size, 0,
+		    UIO_SYSSPACE, IO_NODELOCKED, td->td_ucred, NOCRED, &resid,
+		    td);
+		if (error == 0 && resid != 0)
+			error = EFTYPE;
+	}
+	VOP_UNLOCK(vp, 0);
+	vn_close(vp, FREAD, td->td_ucred, td);
+	if (error == 0)
+		error = vboxfs_index_verify(image, va.va_size);
+	ih = (struct vboxfs_index_hdr *)image;
+	if (error == 0 && strcmp(ih->ih_share, ix->ix_share) != 0)
+		error = EFTYPE;
+	if (error != 0) {
+		if (image != NULL)
+			free(image, M_VBOXVFS);
+		return (error);
+	}
+
+	/* Copied out, so that the arrays can grow. */
+	ix->ix_nents = ix->ix_entsize = ih->ih_nents;
+	ix->ix_ents = malloc(ih->ih_nents * sizeof(*ix->ix_ents), M_VBOXVFS,
+	    M_WAITOK);
+	memcpy(ix->ix_ents, image + ih->ih_entoff,
+	    ih->ih_nents * sizeof(*ix->ix_ents));
+	ix->ix_namelen = ix->ix_namesize = ih->ih_namelen;
+	ix->ix_names = malloc(ih->ih_namelen, M_VBOXVFS, M_WAITOK);
+	memcpy(ix->ix_names, image + ih->ih_nameoff, ih->ih_namelen);
+	free(image, M_VBOXVFS);
+	return (0);
+}
+
+/*
+ * Index share 'share'.  With an index 'file' that can be loaded, the
+ * share is checked lazily, as it is used.  Otherwise the whole share is
+ * crawled, which costs one listing per directory, and the file written.
+ * A directory the crawl cannot list, one the guest may not read for
+ * instance, is left unlisted and tried again when it is used; only the
+ * root has to be listed for the mount to go ahead.
+ */
+int
+vboxfs_index_build(sfp_mount_t *mnt, const char *share, const char *file,
+    struct vboxfs_index **ixp)
+{
+	struct vboxfs_index *ix;
+	uint32_t e;
+	int error;
+
+	ix = malloc(sizeof(*ix), M_VBOXVFS, M_WAITOK | M_ZERO);
+	sx_init(&ix->ix_lock, "vboxfs index");
+	ix->ix_mnt = mnt;
+	strlcpy(ix->ix_share, share, sizeof(ix->ix_share));
+	if (file != NULL) {
+		ix->ix_file = malloc(strlen(file) + 1, M_VBOXVFS, M_WAITOK);
+		strcpy(ix->ix_file, file);
+		if (vboxfs_index_load(ix) == 0) {
+			*ixp = ix;
+			return (0);
+		}
+	}
+
+	sx_xlock(&ix->ix_lock);
+	(void) vboxfs_index_add(ix, 0, "", 0);
+	error = vboxfs_index_check(ix, 0);
+	for (e = 1; e < ix->ix_nents && error == 0; e++)
+		(void) vboxfs_index_check(ix, e);
+	sx_xunlock(&ix->ix_lock);
+	if (error == 0 && ix->ix_file != NULL)
+		(void) vboxfs_index_save(ix);
+	else if (error != 0) {
+		ix->ix_dirty = 0;
+		vboxfs_index_free(ix);
+		ix = NULL;
+	}
+	*ixp = ix;
+	return (error);
+}
+
+/*
+ * Free the index, first writing the file if it is out of date.
+ */
+void
+vboxfs_index_free(struct vboxfs_index *ix)
+{
+	if (ix->ix_dirty)
+		(void) vboxfs_index_save(ix);
+	if (ix->ix_ents != NULL)
+		free(ix->ix_ents, M_VBOXVFS);
+	if (ix->ix_names != NULL)
+		free(ix->ix_names, M_VBOXVFS);
+	if (ix->ix_file != NULL)
+		free(ix->ix_file, M_VBOXVFS);
+	sx_destroy(&ix->ix_lock);
+	free(ix, M_VBOXVFS);
+}
+
+/*
+ * Find 'name' in directory entry 'dir', and return its entry and
+ * attributes.
+ */
+int
+vboxfs_index_lookup(struct vboxfs_index *ix, uint32_t dir, const char *name,
+    int namelen, uint32_t *entp, sffs_stat_t *stat)
+{
+	struct vboxfs_ient *ie;
+	sffs_cstat_t cs;
+	uint32_t lo, hi, mid;
+	int error, r;
+
+	error = vboxfs_index_slock(ix, dir);
+	if (error != 0)
+		return (error);
+	ie = &ix->ix_ents[dir];
+	lo = ie->ie_first;
+	hi = ie->ie_first + ie->ie_nchild;
+	error = ENOENT;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		r = vboxfs_index_namecmp(name, namelen, IX_NAME(ix, mid),
+		    ix->ix_ents[mid].ie_namelen);
+		if (r == 0) {
+			error = 0;
+			break;
+		}
+		if (r < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	sx_sunlock(&ix->ix_lock);
+	if (error != 0)
+		return (error);
+
+	/* Entries are never moved, only appended. */
+	error = vboxfs_index_slock(ix, mid);
+	if (error != 0)
+		return (error);
+	vboxfs_index_to_cstat(&cs, &ix->ix_ents[mid]);
+	sx_sunlock(&ix->ix_lock);
+	sfprov_stat_from_cstat(stat, &cs);
+	*entp = mid;
+	return (0);
+}
+
+int
+vboxfs_index_stat(struct vboxfs_index *ix, uint32_t e, sffs_stat_t *stat)
+{
+	sffs_cstat_t cs;
+	int error;
+
+	error = vboxfs_index_slock(ix, e);
+	if (error != 0)
+		return (error);
+	vboxfs_index_to_cstat(&cs, &ix->ix_ents[e]);
+	sx_sunlock(&ix->ix_lock);
+	sfprov_stat_from_cstat(stat, &cs);
+	return (0);
+}
+
+/*
+ * Append a record for 'name' to the listing buffers at *bufp.
+ */
+static void
+vboxfs_index_emit(sffs_dirents_t **bufp, const char *name, int namelen,
+    const struct vboxfs_ient *ie)
+{
+	sffs_dirents_t *cur_buf = *bufp;
+	struct dirent *dirent;
+	unsigned short reclen;
+
+	reclen = DIRENT_RECLEN(namelen);
+	if (SFFS_DIRENTS_OFF + cur_buf->sf_len + reclen +
+	    (cur_buf->sf_nents + 1) * sizeof(sffs_cstat_t) >
+	    SFFS_DIRENTS_SIZE) {
+		cur_buf->sf_next = malloc(SFFS_DIRENTS_SIZE, M_VBOXVFS,
+		    M_WAITOK | M_ZERO);
+		cur_buf = *bufp = cur_buf->sf_next;
+	}
+	dirent = (struct dirent *)(&cur_buf->sf_entries[0] + cur_buf->sf_len);
+	memcpy(dirent->d_name, name, namelen);
+	dirent->d_name[namelen] = '\0';
+	dirent->d_reclen = reclen;
+	dirent->d_namlen = namelen;
+	dirent->d_type = IFTODT(ie->ie_mode);
+	setbit(cur_buf->sf_recmap, cur_buf->sf_len / sizeof(uint64_t));
+	vboxfs_index_to_cstat(SFFS_DIRENTS_STAT(cur_buf, cur_buf->sf_nents),
+	    ie);
+	cur_buf->sf_len += reclen;
+	cur_buf->sf_nents++;
+}
+
+/*
+ * Build the listing of directory entry 'dir' in the form sfprov_readdir()
+ * returns it, starting with "." and "..".
+ */
+int
+vboxfs_index_readdir(struct vboxfs_index *ix, uint32_t dir,
+    sffs_dirents_t **dirents)
+{
+	struct vboxfs_ient *ie;
+	sffs_dirents_t *cur_buf;
+	uint32_t e;
+	int error;
+
+	error = vboxfs_index_slock(ix, dir);
+	if (error != 0)
+		return (error);
+	ie = &ix->ix_ents[dir];
+	*dirents = cur_buf = malloc(SFFS_DIRENTS_SIZE, M_VBOXVFS,
+	    M_WAITOK | M_ZERO);
+	vboxfs_index_emit(&cur_buf, ".", 1, ie);
+	vboxfs_index_emit(&cur_buf, "..", 2, &ix->ix_ents[ie->ie_parent]);
+	for (e = ie->ie_first; e < ie->ie_first + ie->ie_nchild; e++)
+		vboxfs_index_emit(&cur_buf, IX_NAME(ix, e),
+		    ix->ix_ents[e].ie_namelen, &ix->ix_ents[e]);
+	sx_sunlock(&ix->ix_lock);
+	return (0);
+}
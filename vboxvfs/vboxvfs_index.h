@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2008-2012 Oracle Corporation
+ *
+ * This file is part of VirtualBox Open Source Edition (OSE), as
+ * available from http://www.virtualbox.org. This file is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * General Public License (GPL) as published by the Free Software
+ * Foundation, in version 2 as it comes in the "COPYING" file of the
+ * VirtualBox OSE distribution. VirtualBox OSE is distributed in the
+ * hope that it will be useful, but WITHOUT ANY WARRANTY of any kind.
+ */
+
+#ifndef	___VBOXVFS_INDEX_H___
+#define	___VBOXVFS_INDEX_H___
+
+/*
+ * Format of the metadata index of an immutable mount, see
+ * vboxvfs_index.c.  It is used as is both in memory and in the index
+ * file, and is shared with the vboxfs_index(8) tool, so this header
+ * must not depend on anything kernel or VirtualBox specific.
+ *
+ * An index file holds a header, the entry array and the name pool, each
+ * at an 8 byte aligned offset, so the file can be used mapped.  Entry 0
+ * is the root of the share.  The children of a listed directory are
+ * ie_nchild consecutive entries starting at ie_first, sorted by name
+ * (see vboxfs_index_namecmp()).  Every entry comes after its parent.
+ * Names are NUL terminated; ie_name is the offset of one in the pool.
+ * Values are in host byte order: the file is only meant to be read back
+ * by the machine that wrote it.
+ */
+#define	VBOXFS_INDEX_MAGIC	0x58494256	/* "VBIX" */
+#define	VBOXFS_INDEX_VERSION	1
+#define	VBOXFS_INDEX_SHARELEN	128
+
+struct vboxfs_index_hdr {
+	uint32_t	ih_magic;
+	uint32_t	ih_version;
+	uint32_t	ih_nents;
+	uint32_t	ih_entsize;	/* sizeof(struct vboxfs_ient) */
+	uint64_t	ih_entoff;	/* file offset of the entry array */
+	uint64_t	ih_nameoff;	/* file offset of the name pool */
+	uint64_t	ih_namelen;	/* bytes in the name pool */
+	char		ih_share[VBOXFS_INDEX_SHARELEN]; /* share name */
+};
+
+struct vboxfs_ient {
+	int64_t		ie_atime_ns;	/* times in ns since the epoch */
+	int64_t		ie_mtime_ns;
+	int64_t		ie_ctime_ns;
+	uint64_t	ie_size;
+	uint64_t	ie_alloc;
+	uint32_t	ie_mode;
+	uint32_t	ie_flags;	/* VBOXFS_IENT_* */
+	uint32_t	ie_name;	/* offset of the name in the pool */
+	uint32_t	ie_namelen;
+	uint32_t	ie_parent;
+	uint32_t	ie_first;	/* first child, if VBOXFS_IENT_LISTED */
+	uint32_t	ie_nchild;
+	uint32_t	ie_pad;
+};
+
+#define	VBOXFS_IENT_LISTED	0x0001	/* ie_first and ie_nchild are set */
+#define	VBOXFS_IENT_CHECKED	0x0002	/* matches the host (in memory only) */
+
+int	vboxfs_index_namecmp(const char *, int, const char *, int);
+int	vboxfs_index_verify(const void *, size_t);
+
+#endif	/* !___VBOXVFS_INDEX_H___ */
@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2008-2012 Oracle Corporation
+ *
+ * This file is part of VirtualBox Open Source Edition (OSE), as
+ * available from http://www.virtualbox.org. This file is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * General Public License (GPL) as published by the Free Software
+ * Foundation, in version 2 as it comes in the "COPYING" file of the
+ * VirtualBox OSE distribution. VirtualBox OSE is distributed in the
+ * hope that it will be useful, but WITHOUT ANY WARRANTY of any kind.
+ */
+
+/*
+ * Index file checks, built into both the kernel module and the
+ * vboxfs_index(8) tool.
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/dirent.h>
+#include <sys/stat.h>
+#ifdef _KERNEL
+#include <sys/systm.h>
+#else
+#include <errno.h>
+#include <string.h>
+#endif
+
+#include "vboxvfs_index.h"
+
+/*
+ * The order of names within a directory: bytewise, shorter first.
+ */
+int
+vboxfs_index_namecmp(const char *n1, int l1, const char *n2, int l2)
+{
+	int r;
+
+	r = memcmp(n1, n2, MIN(l1, l2));
+	return (r != 0 ? r : l1 - l2);
+}
+
+/*
+ * Whether 'name' can be a directory entry: no empty name, none longer
+ * than a struct dirent holds, no '.' or '..' and no '/', which would
+ * make vboxfs_index_path() build the path of another file.
+ */
+static int
+vboxfs_index_name_ok(const char *name, uint32_t len)
+{
+
+	if (len == 0 || len > MAXNAMLEN || memchr(name, '/', len) != NULL)
+		return (0);
+	if (name[0] == '.' && (len == 1 || (len == 2 && name[1] == '.')))
+		return (0);
+	return (1);
+}
+
+/*
+ * Check that the 'len' byte index file image at 'buf' is well formed, so
+ * that it can be used without further bounds checks.  Returns EFTYPE if
+ * it is not an index of this version, EINVAL if it is corrupt.
+ */
+int
+vboxfs_index_verify(const void *buf, size_t len)
+{
+	const struct vboxfs_index_hdr *ih = buf;
+	const struct vboxfs_ient *ents, *ie, *c;
+	const char *names;
+	uint32_t e, i;
+
+	if (len < sizeof(*ih) || ih->ih_magic != VBOXFS_INDEX_MAGIC ||
+	    ih->ih_version != VBOXFS_INDEX_VERSION ||
+	    ih->ih_entsize != sizeof(*ie))
+		return (EFTYPE);
+	if (ih->ih_nents == 0 || ih->ih_namelen == 0 ||
+	    ih->ih_entoff < sizeof(*ih) || ih->ih_entoff % 8 != 0 ||
+	    ih->ih_nameoff % 8 != 0 ||
+	    ih->ih_entoff > ih->ih_nameoff || ih->ih_nameoff > len ||
+	    ih->ih_nents > (ih->ih_nameoff - ih->ih_entoff) / sizeof(*ie) ||
+	    ih->ih_namelen > len - ih->ih_nameoff ||
+	    memchr(ih->ih_share, '\0', sizeof(ih->ih_share)) == NULL)
+		return (EINVAL);
+
+	ents = (const struct vboxfs_ient *)((const char *)buf +
+	    ih->ih_entoff);
+	names = (const char *)buf + ih->ih_nameoff;
+	if (names[ih->ih_namelen - 1] != '\0' || ents[0].ie_parent != 0 ||
+	    !S_ISDIR(ents[0].ie_mode))
+		return (EINVAL);
+	for (e = 0; e < ih->ih_nents; e++) {
+		ie = &ents[e];
+		if (ie->ie_name >= ih->ih_namelen ||
+		    ie->ie_namelen >= ih->ih_namelen - ie->ie_name ||
+		    names[ie->ie_name + ie->ie_namelen] != '\0' ||
+		    (e != 0 && ie->ie_parent >= e))
+			return (EINVAL);
+		/* The root has no name. */
+		if (e == 0 ? ie->ie_namelen != 0 :
+		    !vboxfs_index_name_ok(names + ie->ie_name, ie->ie_namelen))
+			return (EINVAL);
+	}
+	for (e = 0; e < ih->ih_nents; e++) {
+		ie = &ents[e];
+		if ((ie->ie_flags & VBOXFS_IENT_LISTED) == 0 ||
+		    ie->ie_nchild == 0)
+			continue;
+		if (!S_ISDIR(ie->ie_mode) || ie->ie_first <= e ||
+		    ie->ie_first > ih->ih_nents ||
+		    ie->ie_nchild > ih->ih_nents - ie->ie_first)
+			return (EINVAL);
+		for (i = 0; i < ie->ie_nchild; i++) {
+			c = &ents[ie->ie_first + i];
+			if (c->ie_parent != e)
+				return (EINVAL);
+			if (i != 0 && vboxfs_index_namecmp(
+			    names + c[-1].ie_name, c[-1].ie_namelen,
+			    names + c->ie_name, c->ie_namelen) >= 0)
+				return (EINVAL);
+		}
+	}
+	return (0);
+}
@@ -33,12 +33,16 @@
 #include <sys/vnode.h>
 #include <sys/dirent.h>
 #include <sys/proc.h>
+#include <sys/lock.h>
+#include <sys/rwlock.h>
+#include <sys/sx.h>
 #include <vm/vm.h>
 #include <vm/pmap.h>
 #include <vm/vm_kern.h>
 #include <vm/vm_map.h>
 #include <vm/vm_object.h>
 #include <vm/vm_extern.h>
+#include <vm/uma.h>
 #include "vboxvfs.h"
 
 #define DIRENT_RECLEN(namelen)    \
@@ -69,7 +73,7 @@ sfprov_string(char *path, int *sz)
 	SHFLSTRING *str;
 	int len = strlen(path);
 
-	*sz = len + 1 + sizeof (*str) - sizeof (str->String);
+	*sz = len + 1 + SFPROV_STRING_HDR;
 	str = malloc(*sz, M_VBOXVFS, M_WAITOK | M_ZERO);
 	str->u16Size = len + 1;
 	str->u16Length = len;
@@ -77,6 +81,91 @@ sfprov_string(char *path, int *sz)
 	return (str);
 }
 
+/*
+ * Encode a path once, for a node that keeps it for its whole lifetime.
+ */
+SHFLSTRING *
+sfprov_string_alloc(const char *path, int len)
+{
+	SHFLSTRING *str;
+
+	str = malloc(SFPROV_STRING_HDR + len + 1, M_VBOXVFS, M_WAITOK);
+	str->u16Size = len + 1;
+	str->u16Length = len;
+	memcpy(str->String.utf8, path, len);
+	str->String.utf8[len] = '\0';
+	return (str);
+}
+
+void
+sfprov_string_free(SHFLSTRING *str)
+{
+
+	free(str, M_VBOXVFS);
+}
+
+/*
+ * Scratch strings for transient paths (lookups, creates, renames).  They
+ * come from a UMA zone, so the per-CPU bucket caches serve them without
+ * going to malloc(9), the same way namei(9) buffers are handled.
+ */
+static uma_zone_t sfprov_path_zone;
+
+SHFLSTRING *
+sfprov_path_get(void)
+{
+	SHFLSTRING *str;
+
+	str = uma_zalloc(sfprov_path_zone, M_WAITOK);
+	str->u16Size = MAXPATHLEN;
+	str->u16Length = 0;
+	str->String.utf8[0] = '\0';
+	return (str);
+}
+
+void
+sfprov_path_put(SHFLSTRING *str)
+{
+
+	uma_zfree(sfprov_path_zone, str);
+}
+
+/*
+ * Build "dir/name" into the scratch string dst.
+ */
+int
+sfprov_path_child(SHFLSTRING *dst, SHFLSTRING *dir, const char *name,
+    int namelen)
+{
+	int len;
+
+	len = dir->u16Length + 1 + namelen;
+	if (len + 1 > dst->u16Size)
+		return (ENAMETOOLONG);
+	memcpy(dst->String.utf8, dir->String.utf8, dir->u16Length);
+	dst->String.utf8[dir->u16Length] = '/';
+	memcpy(dst->String.utf8 + dir->u16Length + 1, name, namelen);
+	dst->String.utf8[len] = '\0';
+	dst->u16Length = len;
+	return (0);
+}
+
+/*
+ * Copy a C string into the scratch string dst.
+ */
+static int
+sfprov_path_set(SHFLSTRING *dst, const char *src)
+{
+	size_t len;
+
+	len = strlen(src);
+	if (len + 1 > dst->u16Size)
+		return (ENAMETOOLONG);
+	memcpy(dst->String.utf8, src, len + 1);
+	dst->u16Length = len;
+	return (0);
+}
+
 sfp_connection_t *
 sfprov_connect(int version)
 {
@@ -92,13 +181,19 @@ sfprov_connect(int version)
 	if (RT_FAILURE(VbglR0SfInit()))
 		return (NULL);
 
+	sfprov_path_zone = uma_zcreate("vboxfs path",
+	    SFPROV_STRING_HDR + MAXPATHLEN, NULL, NULL, NULL, NULL,
+	    UMA_ALIGN_PTR, 0);
+
 	if (RT_FAILURE(VbglR0SfConnect(&vbox_client))) {
+		uma_zdestroy(sfprov_path_zone);
 		VbglR0SfTerm();
 		return (NULL);
 	}
 
 	if (RT_FAILURE(VbglR0SfSetUtf8(&vbox_client))) {
 		VbglR0SfDisconnect(&vbox_client);
+		uma_zdestroy(sfprov_path_zone);
 		VbglR0SfTerm();
 		return (NULL);
 	}
@@ -109,6 +204,7 @@ void
 sfprov_disconnect()
 {
 	VbglR0SfDisconnect(&vbox_client);
+	uma_zdestroy(sfprov_path_zone);
 	VbglR0SfTerm();
 }
 
@@ -283,6 +379,13 @@ sfprov_ftime_from_timespec(struct timespec *time, RTTIMESPEC *ts)
 	time->tv_nsec = nanosec % UINT64_C(1000000000);
 }
 
+static void
+sfprov_ftime_from_nsec(struct timespec *time, int64_t nanosec)
+{
+	time->tv_sec = nanosec / INT64_C(1000000000);
+	time->tv_nsec = nanosec % INT64_C(1000000000);
+}
+
 static void
 sfprov_stat_from_info(sffs_stat_t *stat, SHFLFSOBJINFO *info)
 {
@@ -294,6 +397,28 @@ sfprov_stat_from_info(sffs_stat_t *stat, SHFLFSOBJINFO *info)
 	sfprov_ftime_from_timespec(&stat->sf_ctime, &info->ChangeTime);
 }
 
+static void
+sfprov_cstat_from_info(sffs_cstat_t *cs, SHFLFSOBJINFO *info)
+{
+	sfprov_mode_from_fmode(&cs->sf_mode, info->Attr.fMode);
+	cs->sf_size = info->cbObject;
+	cs->sf_alloc = info->cbAllocated;
+	cs->sf_atime_ns = RTTimeSpecGetNano(&info->AccessTime);
+	cs->sf_mtime_ns = RTTimeSpecGetNano(&info->ModificationTime);
+	cs->sf_ctime_ns = RTTimeSpecGetNano(&info->ChangeTime);
+}
+
+void
+sfprov_stat_from_cstat(sffs_stat_t *stat, const sffs_cstat_t *cs)
+{
+	stat->sf_mode = cs->sf_mode;
+	stat->sf_size = cs->sf_size;
+	stat->sf_alloc = cs->sf_alloc;
+	sfprov_ftime_from_nsec(&stat->sf_atime, cs->sf_atime_ns);
+	sfprov_ftime_from_nsec(&stat->sf_mtime, cs->sf_mtime_ns);
+	sfprov_ftime_from_nsec(&stat->sf_ctime, cs->sf_ctime_ns);
+}
+
 /*
  * File operations: open/close/read/write/etc.
  *
@@ -303,7 +428,7 @@ sfprov_stat_from_info(sffs_stat_t *stat, SHFLFSOBJINFO *info)
 int
 sfprov_create(
 	sfp_mount_t *mnt,
-	char *path,
+	SHFLSTRING *path,
 	mode_t mode,
 	sfp_file_t **fp,
 	sffs_stat_t *stat)
@@ -311,18 +436,14 @@ sfprov_create(
 
 	int rc;
 	SHFLCREATEPARMS parms;
-	SHFLSTRING *str;
-	int size;
 	sfp_file_t *newfp;
 
-	str = sfprov_string(path, &size);
 	parms.Handle = SHFL_HANDLE_NIL;
 	parms.Info.cbObject = 0;
 	sfprov_fmode_from_mode(&parms.Info.Attr.fMode, mode);
 	parms.CreateFlags = SHFL_CF_ACT_CREATE_IF_NEW |
 	    SHFL_CF_ACT_REPLACE_IF_EXISTS | SHFL_CF_ACCESS_READWRITE;
-	rc = VbglR0SfCreate(&vbox_client, &mnt->map, str, &parms);
-	free(str, M_VBOXVFS);
+	rc = VbglR0SfCreate(&vbox_client, &mnt->map, path, &parms);
 
 	if (RT_FAILURE(rc))
 		return (sfprov_vbox2errno(rc));
@@ -340,12 +461,10 @@ sfprov_create(
 }
 
 int
-sfprov_open(sfp_mount_t *mnt, char *path, sfp_file_t **fp)
+sfprov_open(sfp_mount_t *mnt, SHFLSTRING *path, sfp_file_t **fp)
 {
 	int rc;
 	SHFLCREATEPARMS parms;
-	SHFLSTRING *str;
-	int size;
 	sfp_file_t *newfp;
 
 	/*
@@ -353,35 +472,24 @@ sfprov_open(sfp_mount_t *mnt, char *path, sfp_file_t **fp)
 	 * try read only.
 	 */
 	bzero(&parms, sizeof(parms));
-	str = sfprov_string(path, &size);
 	parms.Handle = SHFL_HANDLE_NIL;
 	parms.Info.cbObject = 0;
 	parms.CreateFlags = SHFL_CF_ACT_FAIL_IF_NEW | SHFL_CF_ACCESS_READWRITE;
-	rc = VbglR0SfCreate(&vbox_client, &mnt->map, str, &parms);
-	if (RT_FAILURE(rc) && rc != VERR_ACCESS_DENIED) {
-		free(str, M_VBOXVFS);
+	rc = VbglR0SfCreate(&vbox_client, &mnt->map, path, &parms);
+	if (RT_FAILURE(rc) && rc != VERR_ACCESS_DENIED)
 		return (sfprov_vbox2errno(rc));
-	}
 	if (parms.Handle == SHFL_HANDLE_NIL) {
 		if (parms.Result == SHFL_PATH_NOT_FOUND ||
-		    parms.Result == SHFL_FILE_NOT_FOUND) {
-			free(str, M_VBOXVFS);
+		    parms.Result == SHFL_FILE_NOT_FOUND)
 			return (ENOENT);
-		}
 		parms.CreateFlags =
 		    SHFL_CF_ACT_FAIL_IF_NEW | SHFL_CF_ACCESS_READ;
-		rc = VbglR0SfCreate(&vbox_client, &mnt->map, str, &parms);
-		if (RT_FAILURE(rc)) {
-			free(str, M_VBOXVFS);
+		rc = VbglR0SfCreate(&vbox_client, &mnt->map, path, &parms);
+		if (RT_FAILURE(rc))
 			return (sfprov_vbox2errno(rc));
-		}
-		if (parms.Handle == SHFL_HANDLE_NIL) {
-			free(str, M_VBOXVFS);
+		if (parms.Handle == SHFL_HANDLE_NIL)
 			return (ENOENT);
-		}
 	}
-	else
-		free(str, M_VBOXVFS);
 	newfp = malloc(sizeof(sfp_file_t), M_VBOXVFS, M_WAITOK | M_ZERO);
 	newfp->handle = parms.Handle;
 	newfp->map = mnt->map;
@@ -389,24 +497,51 @@ sfprov_open(sfp_mount_t *mnt, char *path, sfp_file_t **fp)
 	return (0);
 }
 
+/*
+ * Open a directory for listing.  Directories are only ever read, so this
+ * takes one host call where sfprov_open() first tries read/write.
+ */
 int
-sfprov_trunc(sfp_mount_t *mnt, char *path)
+sfprov_opendir(sfp_mount_t *mnt, SHFLSTRING *path, sfp_file_t **fp)
+{
+	int rc;
+	SHFLCREATEPARMS parms;
+	sfp_file_t *newfp;
+
+	bzero(&parms, sizeof(parms));
+	parms.Handle = SHFL_HANDLE_NIL;
+	parms.CreateFlags = SHFL_CF_DIRECTORY | SHFL_CF_ACT_OPEN_IF_EXISTS |
+	    SHFL_CF_ACT_FAIL_IF_NEW | SHFL_CF_ACCESS_READ;
+	rc = VbglR0SfCreate(&vbox_client, &mnt->map, path, &parms);
+	if (RT_FAILURE(rc))
+		return (sfprov_vbox2errno(rc));
+	if (parms.Handle == SHFL_HANDLE_NIL) {
+		if (parms.Result == SHFL_PATH_NOT_FOUND ||
+		    parms.Result == SHFL_FILE_NOT_FOUND)
+			return (ENOENT);
+		return (ENOTDIR);
+	}
+	newfp = malloc(sizeof(sfp_file_t), M_VBOXVFS, M_WAITOK | M_ZERO);
+	newfp->handle = parms.Handle;
+	newfp->map = mnt->map;
+	*fp = newfp;
+	return (0);
+}
+
+int
+sfprov_trunc(sfp_mount_t *mnt, SHFLSTRING *path)
 {
 	int rc;
 	SHFLCREATEPARMS parms;
-	SHFLSTRING *str;
-	int size;
 
 	/*
 	 * open it read/write.
 	 */
-	str = sfprov_string(path, &size);
 	parms.Handle = 0;
 	parms.Info.cbObject = 0;
 	parms.CreateFlags = SHFL_CF_ACT_FAIL_IF_NEW | SHFL_CF_ACCESS_READWRITE |
 	    SHFL_CF_ACT_OVERWRITE_IF_EXISTS;
-	rc = VbglR0SfCreate(&vbox_client, &mnt->map, str, &parms);
-	free(str, M_VBOXVFS);
+	rc = VbglR0SfCreate(&vbox_client, &mnt->map, path, &parms);
 
 	if (RT_FAILURE(rc)) {
 		return (sfprov_vbox2errno(rc));
@@ -438,6 +573,30 @@ sfprov_read(sfp_file_t *fp, char *buffer, uint64_t offset, uint32_t *numbytes,
 	return (0);
 }
 
+/*
+ * Page list reads and writes hand the host the physical addresses of the
+ * caller's pages, so the data moves directly to or from them.
+ */
+int
+sfprov_can_read_pages(void)
+{
+
+	return (VbglR0CanUsePhysPageList());
+}
+
+int
+sfprov_read_pages(sfp_file_t *fp, uint64_t offset, uint32_t *numbytes,
+    uint16_t pgoff, uint16_t npages, RTGCPHYS64 *pages)
+{
+	int rc;
+
+	rc = VbglR0SfReadPageList(&vbox_client, &fp->map, fp->handle, offset,
+	    numbytes, pgoff, npages, pages);
+	if (RT_FAILURE(rc))
+		return (sfprov_vbox2errno(rc));
+	return (0);
+}
+
 int
 sfprov_write(sfp_file_t *fp, char *buffer, uint64_t offset, uint32_t *numbytes,
     int buflocked)
@@ -451,6 +610,19 @@ sfprov_write(sfp_file_t *fp, char *buffer, uint64_t offset, uint32_t *numbytes,
 	return (0);
 }
 
+int
+sfprov_write_pages(sfp_file_t *fp, uint64_t offset, uint32_t *numbytes,
+    uint16_t pgoff, uint16_t npages, RTGCPHYS64 *pages)
+{
+	int rc;
+
+	rc = VbglR0SfWritePageList(&vbox_client, &fp->map, fp->handle, offset,
+	    numbytes, pgoff, npages, pages);
+	if (RT_FAILURE(rc))
+		return (sfprov_vbox2errno(rc));
+	return (0);
+}
+
 int
 sfprov_fsync(sfp_file_t *fp)
 {
@@ -464,19 +636,15 @@ sfprov_fsync(sfp_file_t *fp)
 
 
 static int
-sfprov_getinfo(sfp_mount_t *mnt, char *path, PSHFLFSOBJINFO info)
+sfprov_getinfo(sfp_mount_t *mnt, SHFLSTRING *path, PSHFLFSOBJINFO info)
 {
 	int rc;
 	SHFLCREATEPARMS parms;
-	SHFLSTRING *str;
-	int size;
 
-	str = sfprov_string(path, &size);
 	parms.Handle = 0;
 	parms.Info.cbObject = 0;
 	parms.CreateFlags = SHFL_CF_LOOKUP | SHFL_CF_ACT_FAIL_IF_NEW;
-	rc = VbglR0SfCreate(&vbox_client, &mnt->map, str, &parms);
-	free(str, M_VBOXVFS);
+	rc = VbglR0SfCreate(&vbox_client, &mnt->map, path, &parms);
 
 	if (RT_FAILURE(rc))
 		return (sfprov_vbox2errno(rc));
@@ -490,7 +658,7 @@ sfprov_getinfo(sfp_mount_t *mnt, char *path, PSHFLFSOBJINFO info)
  * get information about a file (or directory)
  */
 int
-sfprov_get_mode(sfp_mount_t *mnt, char *path, mode_t *mode)
+sfprov_get_mode(sfp_mount_t *mnt, SHFLSTRING *path, mode_t *mode)
 {
 	int rc;
 	SHFLFSOBJINFO info;
@@ -503,7 +671,7 @@ sfprov_get_mode(sfp_mount_t *mnt, char *path, mode_t *mode)
 }
 
 int
-sfprov_get_size(sfp_mount_t *mnt, char *path, uint64_t *size)
+sfprov_get_size(sfp_mount_t *mnt, SHFLSTRING *path, uint64_t *size)
 {
 	int rc;
 	SHFLFSOBJINFO info;
@@ -517,7 +685,7 @@ sfprov_get_size(sfp_mount_t *mnt, char *path, uint64_t *size)
 
 
 int
-sfprov_get_atime(sfp_mount_t *mnt, char *path, struct timespec *time)
+sfprov_get_atime(sfp_mount_t *mnt, SHFLSTRING *path, struct timespec *time)
 {
 	int rc;
 	SHFLFSOBJINFO info;
@@ -530,7 +698,7 @@ sfprov_get_atime(sfp_mount_t *mnt, char *path, struct timespec *time)
 }
 
 int
-sfprov_get_mtime(sfp_mount_t *mnt, char *path, struct timespec *time)
+sfprov_get_mtime(sfp_mount_t *mnt, SHFLSTRING *path, struct timespec *time)
 {
 	int rc;
 	SHFLFSOBJINFO info;
@@ -543,7 +711,7 @@ sfprov_get_mtime(sfp_mount_t *mnt, char *path, struct timespec *time)
 }
 
 int
-sfprov_get_ctime(sfp_mount_t *mnt, char *path, struct timespec *time)
+sfprov_get_ctime(sfp_mount_t *mnt, SHFLSTRING *path, struct timespec *time)
 {
 	int rc;
 	SHFLFSOBJINFO info;
@@ -556,7 +724,7 @@ sfprov_get_ctime(sfp_mount_t *mnt, char *path, struct timespec *time)
 }
 
 int
-sfprov_get_attr(sfp_mount_t *mnt, char *path, sffs_stat_t *attr)
+sfprov_get_attr(sfp_mount_t *mnt, SHFLSTRING *path, sffs_stat_t *attr)
 {
 	int rc;
 	SHFLFSOBJINFO info;
@@ -578,7 +746,7 @@ sfprov_timespec_from_ftime(RTTIMESPEC *ts, struct timespec time)
 int
 sfprov_set_attr(
 	sfp_mount_t *mnt,
-	char *path,
+	SHFLSTRING *path,
 	mode_t mode,
 	struct timespec atime,
 	struct timespec mtime,
@@ -586,23 +754,20 @@ sfprov_set_attr(
 {
 	int rc, err;
 	SHFLCREATEPARMS parms;
-	SHFLSTRING *str;
 	SHFLFSOBJINFO info;
 	uint32_t bytes;
-	int str_size;
 
-	str = sfprov_string(path, &str_size);
 	parms.Handle = 0;
 	parms.Info.cbObject = 0;
 	parms.CreateFlags = SHFL_CF_ACT_OPEN_IF_EXISTS
 			  | SHFL_CF_ACT_FAIL_IF_NEW
 			  | SHFL_CF_ACCESS_ATTR_WRITE;
 
-	rc = VbglR0SfCreate(&vbox_client, &mnt->map, str, &parms);
+	rc = VbglR0SfCreate(&vbox_client, &mnt->map, path, &parms);
 
 	if (RT_FAILURE(rc)) {
 		printf("sfprov_set_attr: VbglR0SfCreate(%s) failed rc=%d\n",
-		    path, rc);
+		    path->String.utf8, rc);
 		err = sfprov_vbox2errno(rc);
 		goto fail2;
 	}
@@ -629,7 +794,7 @@ sfprov_set_attr(
 		if (rc != VERR_ACCESS_DENIED && rc != VERR_WRITE_PROTECT)
 		{
 			printf("sfprov_set_attr: VbglR0SfFsInfo(%s, FILE) failed rc=%d\n",
-		    path, rc);
+		    path->String.utf8, rc);
 		}
 		err = sfprov_vbox2errno(rc);
 		goto fail1;
@@ -641,35 +806,31 @@ fail1:
 	rc = VbglR0SfClose(&vbox_client, &mnt->map, parms.Handle);
 	if (RT_FAILURE(rc)) {
 		printf("sfprov_set_attr: VbglR0SfClose(%s) failed rc=%d\n",
-		    path, rc);
+		    path->String.utf8, rc);
 	}
 fail2:
-	free(str, M_VBOXVFS);
 	return err;
 }
 
 int
-sfprov_set_size(sfp_mount_t *mnt, char *path, uint64_t size)
+sfprov_set_size(sfp_mount_t *mnt, SHFLSTRING *path, uint64_t size)
 {
 	int rc, err;
 	SHFLCREATEPARMS parms;
-	SHFLSTRING *str;
 	SHFLFSOBJINFO info;
 	uint32_t bytes;
-	int str_size;
 
-	str = sfprov_string(path, &str_size);
 	parms.Handle = 0;
 	parms.Info.cbObject = 0;
 	parms.CreateFlags = SHFL_CF_ACT_OPEN_IF_EXISTS
 			  | SHFL_CF_ACT_FAIL_IF_NEW
 			  | SHFL_CF_ACCESS_WRITE;
 
-	rc = VbglR0SfCreate(&vbox_client, &mnt->map, str, &parms);
+	rc = VbglR0SfCreate(&vbox_client, &mnt->map, path, &parms);
 
 	if (RT_FAILURE(rc)) {
 		printf("sfprov_set_size: VbglR0SfCreate(%s) failed rc=%d\n",
-		    path, rc);
+		    path->String.utf8, rc);
 		err = sfprov_vbox2errno(rc);
 		goto fail2;
 	}
@@ -685,7 +846,7 @@ sfprov_set_size(sfp_mount_t *mnt, char *path, uint64_t size)
 	    (SHFL_INFO_SET | SHFL_INFO_SIZE), &bytes, (SHFLDIRINFO *)&info);
 	if (RT_FAILURE(rc)) {
 		printf("sfprov_set_size: VbglR0SfFsInfo(%s, SIZE) failed rc=%d\n",
-		    path, rc);
+		    path->String.utf8, rc);
 		err = sfprov_vbox2errno(rc);
 		goto fail1;
 	}
@@ -696,10 +857,9 @@ fail1:
 	rc = VbglR0SfClose(&vbox_client, &mnt->map, parms.Handle);
 	if (RT_FAILURE(rc)) {
 		printf("sfprov_set_size: VbglR0SfClose(%s) failed rc=%d\n",
-		    path, rc);
+		    path->String.utf8, rc);
 	}
 fail2:
-	free(str, M_VBOXVFS);
 	return err;
 }
 
@@ -709,25 +869,21 @@ fail2:
 int
 sfprov_mkdir(
 	sfp_mount_t *mnt,
-	char *path,
+	SHFLSTRING *path,
 	mode_t mode,
 	sfp_file_t **fp,
 	sffs_stat_t *stat)
 {
 	int rc;
 	SHFLCREATEPARMS parms;
-	SHFLSTRING *str;
-	int size;
 	sfp_file_t *newfp;
 
-	str = sfprov_string(path, &size);
 	parms.Handle = SHFL_HANDLE_NIL;
 	parms.Info.cbObject = 0;
 	sfprov_fmode_from_mode(&parms.Info.Attr.fMode, mode);
 	parms.CreateFlags = SHFL_CF_DIRECTORY | SHFL_CF_ACT_CREATE_IF_NEW |
 	    SHFL_CF_ACT_FAIL_IF_EXISTS | SHFL_CF_ACCESS_READ;
-	rc = VbglR0SfCreate(&vbox_client, &mnt->map, str, &parms);
-	free(str, M_VBOXVFS);
+	rc = VbglR0SfCreate(&vbox_client, &mnt->map, path, &parms);
 
 	if (RT_FAILURE(rc))
 		return (sfprov_vbox2errno(rc));
@@ -757,16 +913,12 @@ sfprov_set_show_symlinks(void)
 }
 
 int
-sfprov_remove(sfp_mount_t *mnt, char *path, u_int is_link)
+sfprov_remove(sfp_mount_t *mnt, SHFLSTRING *path, u_int is_link)
 {
 	int rc;
-	SHFLSTRING *str;
-	int size;
 
-	str = sfprov_string(path, &size);
-	rc = VbglR0SfRemove(&vbox_client, &mnt->map, str,
+	rc = VbglR0SfRemove(&vbox_client, &mnt->map, path,
 		SHFL_REMOVE_FILE | (is_link ? SHFL_REMOVE_SYMLINK : 0));
-	free(str, M_VBOXVFS);
 	if (RT_FAILURE(rc))
 		return (sfprov_vbox2errno(rc));
 	return (0);
@@ -775,41 +927,37 @@ sfprov_remove(sfp_mount_t *mnt, char *path, u_int is_link)
 int
 sfprov_readlink(
 	sfp_mount_t *mnt,
-	char *path,
+	SHFLSTRING *path,
 	char *target,
 	size_t tgt_size)
 {
 	int rc;
-	SHFLSTRING *str;
-	int size;
 
-	str = sfprov_string(path, &size);
-
-	rc = VbglR0SfReadLink(&vbox_client, &mnt->map, str, (uint32_t) tgt_size,
+	rc = VbglR0SfReadLink(&vbox_client, &mnt->map, path, (uint32_t) tgt_size,
 	    target);
 	if (RT_FAILURE(rc))
 		rc = sfprov_vbox2errno(rc);
 
-	free(str, M_VBOXVFS);
 	return (rc);
 }
 
 int
 sfprov_symlink(
 	sfp_mount_t *mnt,
-	char *linkname,
+	SHFLSTRING *linkname,
 	char *target,
 	sffs_stat_t *stat)
 {
 	int rc;
-	SHFLSTRING *lnk, *tgt;
-	int lnk_size, tgt_size;
+	SHFLSTRING *tgt;
 	SHFLFSOBJINFO info;
 
-	lnk = sfprov_string(linkname, &lnk_size);
-	tgt = sfprov_string(target, &tgt_size);
+	tgt = sfprov_path_get();
+	rc = sfprov_path_set(tgt, target);
+	if (rc != 0)
+		goto done;
 
-	rc = VbglR0SfSymlink(&vbox_client, &mnt->map, lnk, tgt, &info);
+	rc = VbglR0SfSymlink(&vbox_client, &mnt->map, linkname, tgt, &info);
 	if (RT_FAILURE(rc)) {
 		rc = sfprov_vbox2errno(rc);
 		goto done;
@@ -819,191 +967,243 @@ sfprov_symlink(
 		sfprov_stat_from_info(stat, &info);
 
 done:
-	free(lnk, M_VBOXVFS);
-	free(tgt, M_VBOXVFS);
+	sfprov_path_put(tgt);
 
 	return (rc);
 }
 
 int
-sfprov_rmdir(sfp_mount_t *mnt, char *path)
+sfprov_rmdir(sfp_mount_t *mnt, SHFLSTRING *path)
 {
 	int rc;
-	SHFLSTRING *str;
-	int size;
 
-	str = sfprov_string(path, &size);
-	rc = VbglR0SfRemove(&vbox_client, &mnt->map, str, SHFL_REMOVE_DIR);
-	free(str, M_VBOXVFS);
+	rc = VbglR0SfRemove(&vbox_client, &mnt->map, path, SHFL_REMOVE_DIR);
 	if (RT_FAILURE(rc))
 		return (sfprov_vbox2errno(rc));
 	return (0);
 }
 
 int
-sfprov_rename(sfp_mount_t *mnt, char *from, char *to, u_int is_dir)
+sfprov_rename(sfp_mount_t *mnt, SHFLSTRING *from, SHFLSTRING *to,
+    u_int is_dir)
 {
 	int rc;
-	SHFLSTRING *old, *new;
-	int old_size, new_size;
 
-	old = sfprov_string(from, &old_size);
-	new = sfprov_string(to, &new_size);
-	rc = VbglR0SfRename(&vbox_client, &mnt->map, old, new,
+	rc = VbglR0SfRename(&vbox_client, &mnt->map, from, to,
 	    (is_dir ? SHFL_RENAME_DIR : SHFL_RENAME_FILE) |
 	    SHFL_RENAME_REPLACE_IF_EXISTS);
-	free(old, M_VBOXVFS);
-	free(new, M_VBOXVFS);
 	if (RT_FAILURE(rc))
 		return (sfprov_vbox2errno(rc));
 	return (0);
 }
 
 /*
- * Read all filenames in a directory.
+ * Directory streams hand out a directory's entries one host batch at a
+ * time, so readdir can return the first entries without waiting for the
+ * whole directory.
  *
- * - success - all entries read and returned
- * - ENOENT - Couldn't open the directory for reading
- * - EINVAL - Internal error of some kind
- *
- * On successful return, *dirents points to a list of sffs_dirents_t;
- * for each dirent, all fields except the d_ino will be set appropriately.
- * The caller is responsible for freeing the dirents buffer.
+ * sfprov_readdir_open() reads through 'fp' when the caller already has
+ * the directory open, and otherwise opens it; ENOENT means it couldn't be
+ * opened for reading.  A borrowed handle stays open until the caller
+ * closes it, which must not happen before the stream is closed.  Each
+ * sfprov_readdir_next() call returns the next batch as a list of
+ * sffs_dirents_t, or NULL once the directory is exhausted.  Every field
+ * of each dirent but d_ino is set.  The caller frees the returned
+ * buffers and closes the stream with sfprov_readdir_close().
  */
 int
-sfprov_readdir(
-	sfp_mount_t *mnt,
-	char *path,
-	sffs_dirents_t **dirents)
+sfprov_readdir_open(sfp_mount_t *mnt, SHFLSTRING *path, sfp_file_t *fp,
+    sffs_dirstream_t **dsp)
 {
+	sffs_dirstream_t *ds;
 	int error;
-	char *cp;
-	int len;
-	SHFLSTRING *mask_str = NULL;	/* must be path with "/" appended */
-	int mask_size;
-	sfp_file_t *fp;
-	uint32_t infobuff_alloc = 16384;
-	SHFLDIRINFO *infobuff = NULL, *info;
+
+	ds = malloc(sizeof(*ds), M_VBOXVFS, M_WAITOK | M_ZERO);
+#ifdef SHFL_LIST_RESTART
+	/*
+	 * The host keeps the enumeration position in the handle, so an
+	 * already used handle has to be rewound by the first request.
+	 */
+	if (fp != NULL) {
+		ds->ds_fp = fp;
+		ds->ds_flags = SHFL_LIST_RESTART;
+	} else
+#endif
+	{
+		error = sfprov_opendir(mnt, path, &ds->ds_fp);
+		if (error != 0) {
+			free(ds, M_VBOXVFS);
+			*dsp = NULL;
+			return (ENOENT);
+		}
+		ds->ds_own_fp = 1;
+	}
+
+	/*
+	 * Create mask that VBox expects. This needs to be the directory path,
+	 * plus a "*" wildcard to get all files.
+	 */
+	ds->ds_mask = sfprov_path_get();
+	error = sfprov_path_child(ds->ds_mask, path, "*", 1);
+	if (error != 0) {
+		sfprov_readdir_close(ds);
+		*dsp = NULL;
+		return (error);
+	}
+
+	ds->ds_infolen = SFFS_DIRINFO_SIZE;
+	ds->ds_info = malloc(ds->ds_infolen, M_VBOXVFS, M_WAITOK | M_ZERO);
+	*dsp = ds;
+	return (0);
+}
+
+int
+sfprov_readdir_next(sffs_dirstream_t *ds, sffs_dirents_t **dirents)
+{
+	int error;
+	SHFLDIRINFO *info;
 	uint32_t numbytes;
 	uint32_t nents;
 	uint32_t size;
-	off_t offset;
 	sffs_dirents_t *cur_buf;
-	struct sffs_dirent *dirent;
+	struct dirent *dirent;
 	unsigned short reclen;
-	unsigned short entlen;
 
 	*dirents = NULL;
-
-	error = sfprov_open(mnt, path, &fp);
-	if (error != 0)
-		return (ENOENT);
+	if (ds->ds_eof)
+		return (0);
+
+	numbytes = ds->ds_infolen;
+	error = VbglR0SfDirInfo(&vbox_client, &ds->ds_fp->map,
+	    ds->ds_fp->handle, ds->ds_mask, ds->ds_flags, 0, &numbytes,
+	    ds->ds_info, &nents);
+	ds->ds_flags = 0;
+
+	switch (error) {
+	case VINF_SUCCESS:
+		break;
+	case VERR_NO_MORE_FILES:
+		ds->ds_eof = 1;
+		break;
+	case VERR_NO_TRANSLATION:
+		/* XXX ??? */
+		break;
+	default:
+		return (sfprov_vbox2errno(error));
+	}
+	if (numbytes == 0 || nents == 0) {
+		ds->ds_eof = 1;
+		return (0);
+	}
 
 	/*
-	 * Allocate the first dirents buffers.
+	 * Allocate the first dirents buffer.
 	 */
-	*dirents = malloc(SFFS_DIRENTS_SIZE,  M_VBOXVFS, M_WAITOK | M_ZERO);
-	if (*dirents == NULL) {
-		error = (ENOSPC);
-		goto done;
-	}
+	*dirents = malloc(SFFS_DIRENTS_SIZE, M_VBOXVFS, M_WAITOK | M_ZERO);
 	cur_buf = *dirents;
 	cur_buf->sf_next = NULL;
 	cur_buf->sf_len = 0;
+	cur_buf->sf_nents = 0;
 
 	/*
-	 * Create mask that VBox expects. This needs to be the directory path,
-	 * plus a "*" wildcard to get all files.
+	 * Create the dirent_t's and save the stats for each name
 	 */
-	len = strlen(path) + 3;
-	cp = malloc(len, M_VBOXVFS, M_WAITOK | M_ZERO);
-	if (cp == NULL) {
-		error = (ENOSPC);
-		goto done;
-	}
-	strcpy(cp, path);
-	strcat(cp, "/*");
-	mask_str = sfprov_string(cp, &mask_size);
-	free(cp, M_VBOXVFS);
+	for (info = ds->ds_info;
+	    (char *) info < (char *) ds->ds_info + numbytes; nents--) {
+		size_t buflen;
+
+		/* expand buffers if we need more space */
+		reclen = DIRENT_RECLEN(strlen(info->name.String.utf8));
+		buflen = SFFS_DIRENTS_OFF + cur_buf->sf_len + reclen +
+		    (cur_buf->sf_nents + 1) * sizeof(sffs_cstat_t);
+		if (buflen > SFFS_DIRENTS_SIZE) {
+			cur_buf->sf_next = malloc(SFFS_DIRENTS_SIZE,
+			    M_VBOXVFS, M_WAITOK | M_ZERO);
+			cur_buf = cur_buf->sf_next;
+			cur_buf->sf_next = NULL;
+			cur_buf->sf_len = 0;
+			cur_buf->sf_nents = 0;
+		}
 
-	/*
-	 * Now loop using VbglR0SfDirInfo
-	 */
-	infobuff = malloc(infobuff_alloc, M_VBOXVFS, M_WAITOK | M_ZERO);
-	if (infobuff == NULL) {
-		error = (ENOSPC);
-		goto done;
+		/* create the dirent with the name, type and len */
+		dirent = (struct dirent *)
+		    (&cur_buf->sf_entries[0] + cur_buf->sf_len);
+		strncpy(&dirent->d_name[0],
+		    info->name.String.utf8, DIRENT_NAMELEN(reclen));
+		dirent->d_reclen = reclen;
+		dirent->d_namlen = strlen(info->name.String.utf8);
+		dirent->d_name[dirent->d_namlen] = 0;
+		setbit(cur_buf->sf_recmap, cur_buf->sf_len / sizeof(uint64_t));
+
+		/* save the stats */
+		sfprov_cstat_from_info(SFFS_DIRENTS_STAT(cur_buf,
+		    cur_buf->sf_nents), &info->Info);
+		dirent->d_type = IFTODT(SFFS_DIRENTS_STAT(cur_buf,
+		    cur_buf->sf_nents)->sf_mode);
+
+		/* next info */
+		cur_buf->sf_len += reclen;
+		cur_buf->sf_nents++;
+		size = offsetof (SHFLDIRINFO, name.String) + info->name.u16Size;
+		info = (SHFLDIRINFO *) ((uintptr_t) info + size);
 	}
+	KASSERT(nents == 0, ("nents != 0"));
+	KASSERT((char *) info == (char *) ds->ds_info + numbytes,
+	    ("(char *) info != (char *) infobuff + numbytes"));
 
-	offset = 0;
-	for (;;) {
-		numbytes = infobuff_alloc;
-		error = VbglR0SfDirInfo(&vbox_client, &fp->map, fp->handle,
-		    mask_str, 0, 0, &numbytes, infobuff, &nents);
+	return (0);
+}
 
-		switch (error) {
-		case VINF_SUCCESS:
-			/* fallthrough */
-		case VERR_NO_MORE_FILES:
-			break;
-		case VERR_NO_TRANSLATION:
-			/* XXX ??? */
-			break;
-		default:
-			error = sfprov_vbox2errno(error);
-			goto done;
-		}
+void
+sfprov_readdir_close(sffs_dirstream_t *ds)
+{
 
-		/*
-		 * Create the dirent_t's and save the stats for each name
-		 */
-		for (info = infobuff; (char *) info < (char *) infobuff + numbytes; nents--) {
-			size_t buflen;
-
-			/* expand buffers if we need more space */
-			reclen = DIRENT_RECLEN(strlen(info->name.String.utf8));
-			entlen = sizeof(struct sffs_dirent) + reclen;
-			buflen = SFFS_DIRENTS_OFF + cur_buf->sf_len + entlen;
-			if (buflen > SFFS_DIRENTS_SIZE) {
-				cur_buf->sf_next = malloc(SFFS_DIRENTS_SIZE,
-				    M_VBOXVFS, M_WAITOK | M_ZERO);
-				if (cur_buf->sf_next == NULL) {
-					error = ENOSPC;
-					goto done;
-				}
-				cur_buf = cur_buf->sf_next;
-				cur_buf->sf_next = NULL;
-				cur_buf->sf_len = 0;
-			}
-
-			/* create the dirent with the name, offset, and len */
-			dirent = (struct sffs_dirent *)
-			    (((char *) &cur_buf->sf_entries[0]) + cur_buf->sf_len);
-			strncpy(&dirent->sf_entry.d_name[0],
-			    info->name.String.utf8, DIRENT_NAMELEN(reclen));
-			dirent->sf_entry.d_reclen = reclen;
-			dirent->sf_entry.d_namlen = strlen(info->name.String.utf8);
-			dirent->sf_entry.d_name[dirent->sf_entry.d_namlen] = 0;
-			offset += entlen;
-			dirent->sf_off = offset;
-
-			/* save the stats */
-			sfprov_stat_from_info(&dirent->sf_stat, &info->Info);
-
-			/* next info */
-			cur_buf->sf_len += entlen;
-			size = offsetof (SHFLDIRINFO, name.String) + info->name.u16Size;
-			info = (SHFLDIRINFO *) ((uintptr_t) info + size);
-		}
-		KASSERT(nents == 0, ("nents != 0"));
-		KASSERT((char *) info == (char *) infobuff + numbytes, "(char *) info != (char *) infobuff + numbytes");
+	if (ds->ds_info != NULL)
+		free(ds->ds_info, M_VBOXVFS);
+	if (ds->ds_mask != NULL)
+		sfprov_path_put(ds->ds_mask);
+	if (ds->ds_own_fp)
+		sfprov_close(ds->ds_fp);
+	free(ds, M_VBOXVFS);
+}
+
+/*
+ * Read all filenames in a directory.
+ *
+ * - success - all entries read and returned
+ * - ENOENT - Couldn't open the directory for reading
+ * - EINVAL - Internal error of some kind
+ *
+ * On successful return, *dirents points to a list of sffs_dirents_t;
+ * for each dirent, all fields except the d_ino will be set appropriately.
+ * The caller is responsible for freeing the dirents buffer.
+ */
+int
+sfprov_readdir(
+	sfp_mount_t *mnt,
+	SHFLSTRING *path,
+	sffs_dirents_t **dirents)
+{
+	int error;
+	sffs_dirstream_t *ds;
+	sffs_dirents_t **tail, *cur_buf;
+
+	*dirents = NULL;
 
-		if (error == VERR_NO_MORE_FILES)
+	error = sfprov_readdir_open(mnt, path, NULL, &ds);
+	if (error != 0)
+		return (error);
+
+	tail = dirents;
+	while (!ds->ds_eof) {
+		error = sfprov_readdir_next(ds, tail);
+		if (error != 0)
 			break;
+		while (*tail != NULL)
+			tail = &(*tail)->sf_next;
 	}
-	error = 0;
+	sfprov_readdir_close(ds);
 
-done:
 	if (error != 0) {
 		while (*dirents) {
 			cur_buf = (*dirents)->sf_next;
@@ -1011,11 +1211,5 @@ done:
 			*dirents = cur_buf;
 		}
 	}
-	if (infobuff != NULL)
-		free(infobuff, M_VBOXVFS);
-	if (mask_str != NULL)
-		free(mask_str, M_VBOXVFS);
-	sfprov_close(fp);
-
 	return (error);
 }
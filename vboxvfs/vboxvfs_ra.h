@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2008-2012 Oracle Corporation
+ *
+ * This file is part of VirtualBox Open Source Edition (OSE), as
+ * available from http://www.virtualbox.org. This file is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * General Public License (GPL) as published by the Free Software
+ * Foundation, in version 2 as it comes in the "COPYING" file of the
+ * VirtualBox OSE distribution. VirtualBox OSE is distributed in the
+ * hope that it will be useful, but WITHOUT ANY WARRANTY of any kind.
+ */
+
+#ifndef	___VBOXVFS_RA_H___
+#define	___VBOXVFS_RA_H___
+
+/*
+ * Read-ahead sizing, see vsfnode_ra_window().  Kept apart from the code
+ * keeping the state, and free of anything kernel or VirtualBox specific
+ * beyond <sys/param.h>, so that vboxvfs/tests can run it in userland.
+ */
+
+/*
+ * Fold a transfer of 'len' bytes that took 'us' microseconds into 'avg',
+ * a running average of the time per block of 'bsize' bytes.  Samples
+ * are clamped so that avg * 7 cannot overflow.
+ */
+static __inline u_int
+vboxfs_ra_avg(u_int avg, uint64_t us, u_int bsize, uint64_t len)
+{
+	uint64_t t;
+
+	t = us * bsize / len;
+	return ((avg * 7 + MIN(t, UINT_MAX / 8)) / 8);
+}
+
+/*
+ * Blocks to read ahead: enough to cover one host read time 'rtt' at the
+ * reader's 'pace' (both per block), bounded by the length of the
+ * sequential run 'seq' and by 'max', and at least one in a run.
+ */
+static __inline int
+vboxfs_ra_window(u_int rtt, u_int pace, int seq, int max)
+{
+	u_int win;
+
+	if (seq <= 0 || max <= 0)
+		return (0);
+	win = howmany(rtt, MAX(pace, 1));
+	return (MAX(MIN(win, (u_int)MIN(seq, max)), 1));
+}
+
+#endif	/* !___VBOXVFS_RA_H___ */
@@ -28,6 +28,16 @@
 #include <sys/malloc.h>
 #include <sys/module.h>
 #include <sys/sbuf.h>
+#include <sys/counter.h>
+#include <sys/eventhandler.h>
+#include <sys/fnv_hash.h>
+#include <sys/lock.h>
+#include <sys/mutex.h>
+#include <sys/refcount.h>
+#include <sys/rwlock.h>
+#include <sys/smp.h>
+#include <sys/sx.h>
+#include <sys/taskqueue.h>
 
 #include <geom/geom.h>
 #include <geom/geom_vfs.h>
@@ -49,6 +59,35 @@ SYSCTL_NODE(_vfs, OID_AUTO, vboxfs, CTLFLAG_RW, 0, "VirtualBox shared filesystem
 SYSCTL_INT(_vfs_vboxfs, OID_AUTO, version, CTLFLAG_RD, &vboxfs_version, 0, "");
 SYSCTL_UINT(_vfs_vboxfs, OID_AUTO, debug, CTLFLAG_RW, &vboxvfs_debug, 0, "Debug level");
 
+static counter_u64_t vboxfs_iobuf_hits;
+static counter_u64_t vboxfs_iobuf_misses;
+SYSCTL_COUNTER_U64(_vfs_vboxfs, OID_AUTO, iobuf_hits, CTLFLAG_RD,
+    &vboxfs_iobuf_hits, "Transfer buffers taken from the per-CPU pool");
+SYSCTL_COUNTER_U64(_vfs_vboxfs, OID_AUTO, iobuf_misses, CTLFLAG_RD,
+    &vboxfs_iobuf_misses, "Transfer buffers allocated outside the pool");
+
+counter_u64_t vboxfs_neg_hits;
+counter_u64_t vboxfs_neg_expired;
+SYSCTL_COUNTER_U64(_vfs_vboxfs, OID_AUTO, neg_hits, CTLFLAG_RD,
+    &vboxfs_neg_hits, "Lookups answered by a negative name cache entry");
+SYSCTL_COUNTER_U64(_vfs_vboxfs, OID_AUTO, neg_expired, CTLFLAG_RD,
+    &vboxfs_neg_expired, "Negative name cache entries found expired");
+
+counter_u64_t vboxfs_prefetch_dirs;
+SYSCTL_COUNTER_U64(_vfs_vboxfs, OID_AUTO, prefetch_dirs, CTLFLAG_RD,
+    &vboxfs_prefetch_dirs, "Directories listed by the prefetch threads");
+
+static eventhandler_tag vboxfs_lowmem_tag;
+
+struct taskqueue *vboxfs_rio_tq;
+
+#define	VBOXFS_DEF_IOBUFS	1	/* pool buffers per CPU */
+#define	VBOXFS_DEF_ACMIN	200	/* attr cache ttl bounds, in ms */
+#define	VBOXFS_DEF_ACMAX	3000
+#define	VBOXFS_MAX_IOBUFS	8
+#define	VBOXFS_DEF_PREFETCHMAX	1024	/* directories listed at mount */
+#define	VBOXFS_MAX_PREFETCHMAX	65536
+
 static vfs_init_t	vboxfs_init;
 static vfs_uninit_t	vboxfs_uninit;
 static vfs_cmount_t	vboxfs_cmount;
@@ -74,6 +113,25 @@ static struct vfsops vboxfs_vfsops = {
 VFS_SET(vboxfs_vfsops, vboxvfs, VFCF_NETWORK);
 MODULE_DEPEND(vboxvfs, vboxguest, 1, 1, 1);
 
+/*
+ * Inode numbers are a hash of the share-relative path, so they are the
+ * same across lookups and remounts, and readdir can compute them for
+ * entries that have no node.  0 and the fixed inode numbers are never
+ * handed out.
+ */
+static ino_t
+vboxfs_hash_to_ino(uint64_t h)
+{
+	ino_t ino;
+
+	if (sizeof(ino_t) < sizeof(h))
+		h ^= h >> 32;
+	ino = (ino_t)h;
+	if (ino <= THEFILE_INO)
+		ino += THEFILE_INO + 1;
+	return (ino);
+}
+
 /*
  * Allocates a new node of type 'type' inside the 'tmp' mount point, with
  * its owner set to 'uid', its group to 'gid' and its mode set to 'mode',
@@ -126,10 +184,54 @@ vboxfs_alloc_node(struct mount *mp, struct vboxfs_mnt *vsfmp, const char *fullpa
 
 	/* Generic initialization. */
 	nnode->sf_type = type;
-	nnode->sf_ino = vsfmp->sf_ino++;
-	nnode->sf_path = strdup(fullpath, M_VBOXVFS);
+	nnode->sf_spath = sfprov_string_alloc(fullpath, strlen(fullpath));
+	nnode->sf_path = nnode->sf_spath->String.utf8;
+	nnode->sf_name = strrchr(nnode->sf_path, '/');
+	nnode->sf_name = (nnode->sf_name != NULL) ? nnode->sf_name + 1 :
+	    nnode->sf_path;
+	nnode->sf_namelen = strlen(nnode->sf_name);
+	nnode->sf_ino = (parent == NULL) ? ROOTDIR_INO :
+	    vboxfs_hash_to_ino(fnv_64_buf(nnode->sf_path,
+	    nnode->sf_spath->u16Length, FNV1_64_INIT));
 	nnode->sf_parent = parent;
 	nnode->vboxfsmp = vsfmp;
+	nnode->sf_file = NULL;
+	nnode->sf_dir_list = NULL;
+	nnode->sf_dir_tail = NULL;
+	nnode->sf_dir_vec = NULL;
+	nnode->sf_dir_nvec = 0;
+	nnode->sf_dir_vecsize = 0;
+	nnode->sf_dir_first = 0;
+	nnode->sf_dir_stream = NULL;
+	nnode->sf_dir_time = 0;
+	nnode->sf_dir_checked = 0;
+	nnode->sf_dir_listed = 0;
+	nnode->sf_dir_index = NULL;
+	nnode->sf_dir_indexmask = 0;
+	nnode->sf_children = 0;
+	nnode->sf_stat_time = 0;
+	nnode->sf_stat_ttl = (type == VDIR) ? vsfmp->sf_acdirmin :
+	    vsfmp->sf_acregmin;
+	nnode->sf_hashed = 0;
+	nnode->sf_ient = 0;
+	timespecclear(&nnode->sf_cache_mtime);
+	nnode->sf_cache_size = 0;
+	nnode->sf_cache_own = 0;
+	nnode->sf_wsize = 0;
+	nnode->sf_rio = 0;
+	/* Writes of earlier nodes for the path may not be flushed yet. */
+	nnode->sf_wgen = 1;
+	nnode->sf_sgen = 0;
+	nnode->sf_ra_next = 0;
+	nnode->sf_ra_len = 0;
+	nnode->sf_ra_seq = 0;
+	nnode->sf_ra_pace = 0;
+	nnode->sf_ra_idle = 0;
+	refcount_init(&nnode->sf_refcnt, 1);
+
+	/* A node keeps its parent alive, so sf_parent is always valid. */
+	if (parent != NULL)
+		vboxfs_node_hold(parent);
 
 	/* Type-specific initialization. */
 	switch (nnode->sf_type) {
@@ -150,22 +252,329 @@ vboxfs_alloc_node(struct mount *mp, struct vboxfs_mnt *vsfmp, const char *fullpa
 	return 0;
 }
 
-void
+static void
 vboxfs_free_node(struct vboxfs_mnt *vboxfs, struct vboxfs_node *node)
 {
 
 #ifdef INVARIANTS
-	TMPFS_NODE_LOCK(node);
+	VBOXFS_NODE_LOCK(node);
 	MPASS(node->sf_vnode == NULL);
-	MPASS((node->sf_vpstate & TMPFS_VNODE_ALLOCATING) == 0);
-	TMPFS_NODE_UNLOCK(node);
+	MPASS((node->sf_vpstate & VBOXFS_VNODE_ALLOCATING) == 0);
+	MPASS(node->sf_hashed == 0);
+	VBOXFS_NODE_UNLOCK(node);
 #endif
-	if (node->sf_path)
-		free(node->sf_path, M_VBOXVFS);
+	vfsnode_clear_dir_list(node);
+	if (node->sf_spath != NULL)
+		sfprov_string_free(node->sf_spath);
+	node->sf_spath = NULL;
+	node->sf_path = NULL;
 
 	uma_zfree(vboxfs->sf_node_pool, node);
 }
 
+/*
+ * Node references are held by the node's vnode, by each child node, by
+ * the mount for the root, and transiently by lookups.  The node leaves
+ * the hash table and is freed when the last one is dropped.
+ */
+void
+vboxfs_node_hold(struct vboxfs_node *node)
+{
+
+	refcount_acquire(&node->sf_refcnt);
+}
+
+void
+vboxfs_node_rele(struct vboxfs_mnt *vboxfsmp, struct vboxfs_node *node)
+{
+	struct vboxfs_node *parent;
+
+	while (node != NULL && refcount_release(&node->sf_refcnt)) {
+		vboxfs_node_unhash(vboxfsmp, node);
+		parent = node->sf_parent;
+		if (parent == node)
+			parent = NULL;
+		vboxfs_free_node(vboxfsmp, node);
+		node = parent;
+	}
+}
+
+/*
+ * Per-mount hash of live nodes, keyed on the parent node and the last
+ * path component.  It lets repeated lookups of the same name share one
+ * node (and its stat cache and vnode) instead of building a new one on
+ * every name cache miss.
+ */
+static uint32_t
+vboxfs_node_hashval(struct vboxfs_node *dir, const char *name, int namelen)
+{
+
+	return (fnv_32_buf(name, namelen,
+	    fnv_32_buf(&dir, sizeof(dir), FNV1_32_INIT)));
+}
+
+#define	VBOXFS_NODE_HASH(vboxfsmp, hv)	\
+	(&(vboxfsmp)->sf_hashtbl[(hv) & (vboxfsmp)->sf_hashmask])
+#define	VBOXFS_INO_HASH(vboxfsmp, ino)	\
+	(&(vboxfsmp)->sf_inohashtbl[(ino) & (vboxfsmp)->sf_inohashmask])
+
+static struct vboxfs_node *
+vboxfs_node_find_locked(struct vboxfs_mnt *vboxfsmp, struct vboxfs_node *dir,
+    const char *name, int namelen, uint32_t hv)
+{
+	struct vboxfs_node *np;
+
+	rw_assert(&vboxfsmp->sf_hashlock, RA_LOCKED);
+	LIST_FOREACH(np, VBOXFS_NODE_HASH(vboxfsmp, hv), sf_hash) {
+		if (np->sf_hashval != hv || np->sf_parent != dir ||
+		    np->sf_namelen != namelen ||
+		    memcmp(np->sf_name, name, namelen) != 0)
+			continue;
+		/* Skip nodes that are on their way out. */
+		if (refcount_acquire_if_not_zero(&np->sf_refcnt))
+			return (np);
+	}
+	return (NULL);
+}
+
+/*
+ * Return the live node for 'name' in 'dir', with a reference the caller
+ * drops with vboxfs_node_rele(), or NULL.
+ */
+struct vboxfs_node *
+vboxfs_node_lookup(struct vboxfs_mnt *vboxfsmp, struct vboxfs_node *dir,
+    const char *name, int namelen)
+{
+	struct vboxfs_node *np;
+	uint32_t hv;
+
+	hv = vboxfs_node_hashval(dir, name, namelen);
+	rw_rlock(&vboxfsmp->sf_hashlock);
+	np = vboxfs_node_find_locked(vboxfsmp, dir, name, namelen, hv);
+	rw_runlock(&vboxfsmp->sf_hashlock);
+	return (np);
+}
+
+static int
+vboxfs_ino_busy(struct vboxfs_mnt *vboxfsmp, ino_t ino)
+{
+	struct vboxfs_node *np;
+
+	rw_assert(&vboxfsmp->sf_hashlock, RA_LOCKED);
+	LIST_FOREACH(np, VBOXFS_INO_HASH(vboxfsmp, ino), sf_inohash)
+		if (np->sf_ino == ino)
+			return (1);
+	return (0);
+}
+
+/*
+ * Enter a freshly allocated node.  If another thread raced us and already
+ * entered a node for the same name, that node is returned referenced and
+ * the caller should discard its own.
+ */
+struct vboxfs_node *
+vboxfs_node_insert(struct vboxfs_mnt *vboxfsmp, struct vboxfs_node *node)
+{
+	struct vboxfs_node *np;
+	uint32_t hv;
+
+	hv = vboxfs_node_hashval(node->sf_parent, node->sf_name,
+	    node->sf_namelen);
+	rw_wlock(&vboxfsmp->sf_hashlock);
+	np = vboxfs_node_find_locked(vboxfsmp, node->sf_parent, node->sf_name,
+	    node->sf_namelen, hv);
+	if (np == NULL) {
+		/*
+		 * Two live paths must not share an inode number.  On a
+		 * hash collision rehash until the number is unique; the
+		 * loser keeps that number for as long as it stays live.
+		 */
+		while (vboxfs_ino_busy(vboxfsmp, node->sf_ino))
+			node->sf_ino = vboxfs_hash_to_ino(fnv_64_buf(
+			    &node->sf_ino, sizeof(node->sf_ino), FNV1_64_INIT));
+		node->sf_hashval = hv;
+		node->sf_hashed = 1;
+		LIST_INSERT_HEAD(VBOXFS_NODE_HASH(vboxfsmp, hv), node, sf_hash);
+		LIST_INSERT_HEAD(VBOXFS_INO_HASH(vboxfsmp, node->sf_ino), node,
+		    sf_inohash);
+		np = node;
+	}
+	rw_wunlock(&vboxfsmp->sf_hashlock);
+	return (np);
+}
+
+/*
+ * Return the inode number of entry 'name' in 'dir': that of its live
+ * node if there is one, since that may have been moved off a collision,
+ * otherwise the hash of its path.
+ */
+ino_t
+vboxfs_child_ino(struct vboxfs_mnt *vboxfsmp, struct vboxfs_node *dir,
+    const char *name, int namelen)
+{
+	struct vboxfs_node *np;
+	ino_t ino;
+
+	np = vboxfs_node_lookup(vboxfsmp, dir, name, namelen);
+	if (np != NULL) {
+		ino = np->sf_ino;
+		vboxfs_node_rele(vboxfsmp, np);
+		return (ino);
+	}
+	return (vboxfs_path_ino(dir, name, namelen));
+}
+
+/*
+ * The inode number of entry 'name' in 'dir' when it has no live node.
+ */
+ino_t
+vboxfs_path_ino(struct vboxfs_node *dir, const char *name, int namelen)
+{
+	uint64_t h;
+
+	h = fnv_64_buf(dir->sf_path, dir->sf_spath->u16Length, FNV1_64_INIT);
+	h = fnv_64_buf("/", 1, h);
+	h = fnv_64_buf(name, namelen, h);
+	return (vboxfs_hash_to_ino(h));
+}
+
+/*
+ * Make the node unreachable by lookups, e.g. once the file is removed.
+ */
+void
+vboxfs_node_unhash(struct vboxfs_mnt *vboxfsmp, struct vboxfs_node *node)
+{
+
+	rw_wlock(&vboxfsmp->sf_hashlock);
+	if (node->sf_hashed) {
+		LIST_REMOVE(node, sf_hash);
+		LIST_REMOVE(node, sf_inohash);
+		node->sf_hashed = 0;
+	}
+	rw_wunlock(&vboxfsmp->sf_hashlock);
+}
+
+/*
+ * Fill the per-CPU transfer buffer pool.  Allocation failures only make
+ * the pool smaller; callers fall back to malloc(9) on a miss.
+ */
+static void
+vboxfs_iopool_init(struct vboxfs_mnt *vboxfsmp, size_t bufsize, int percpu)
+{
+	struct vboxfs_iopool *pool = &vboxfsmp->sf_iopool;
+	struct vboxfs_iopool_cpu *pc;
+	struct vboxfs_iobuf *ib;
+	int cpu, i;
+
+	pool->ip_bufsize = bufsize;
+	pool->ip_nbufs = 0;
+	pool->ip_cpu = malloc((mp_maxid + 1) * sizeof(*pool->ip_cpu),
+	    M_VBOXVFS, M_WAITOK | M_ZERO);
+
+	for (cpu = 0; cpu <= mp_maxid; cpu++) {
+		pc = &pool->ip_cpu[cpu];
+		mtx_init(&pc->ip_lock, "vboxfs iopool", NULL, MTX_DEF);
+		SLIST_INIT(&pc->ip_free);
+		if (CPU_ABSENT(cpu))
+			continue;
+		for (i = 0; i < percpu; i++) {
+			ib = malloc(sizeof(*ib), M_VBOXVFS, M_WAITOK | M_ZERO);
+			ib->ib_data = contigmalloc(bufsize, M_VBOXVFS,
+			    M_WAITOK, 0, ~0, PAGE_SIZE, 0);
+			if (ib->ib_data == NULL) {
+				free(ib, M_VBOXVFS);
+				break;
+			}
+			ib->ib_size = bufsize;
+			ib->ib_pooled = 1;
+			SLIST_INSERT_HEAD(&pc->ip_free, ib, ib_link);
+			pool->ip_nbufs++;
+		}
+	}
+}
+
+static void
+vboxfs_iopool_destroy(struct vboxfs_mnt *vboxfsmp)
+{
+	struct vboxfs_iopool *pool = &vboxfsmp->sf_iopool;
+	struct vboxfs_iopool_cpu *pc;
+	struct vboxfs_iobuf *ib;
+	int cpu;
+
+	if (pool->ip_cpu == NULL)
+		return;
+
+	for (cpu = 0; cpu <= mp_maxid; cpu++) {
+		pc = &pool->ip_cpu[cpu];
+		while ((ib = SLIST_FIRST(&pc->ip_free)) != NULL) {
+			SLIST_REMOVE_HEAD(&pc->ip_free, ib_link);
+			contigfree(ib->ib_data, ib->ib_size, M_VBOXVFS);
+			free(ib, M_VBOXVFS);
+			pool->ip_nbufs--;
+		}
+		mtx_destroy(&pc->ip_lock);
+	}
+	KASSERT(pool->ip_nbufs == 0,
+	    ("vboxfs: %d transfer buffers still in use", pool->ip_nbufs));
+	free(pool->ip_cpu, M_VBOXVFS);
+	pool->ip_cpu = NULL;
+}
+
+/*
+ * Take a transfer buffer of at least 'size' bytes.  The local CPU's pool
+ * is tried first, then the other CPUs'; only when all are empty (or the
+ * request is larger than a pool buffer) is memory allocated.
+ */
+struct vboxfs_iobuf *
+vboxfs_iobuf_get(struct vboxfs_mnt *vboxfsmp, size_t size)
+{
+	struct vboxfs_iopool *pool = &vboxfsmp->sf_iopool;
+	struct vboxfs_iopool_cpu *pc;
+	struct vboxfs_iobuf *ib;
+	int cpu, i;
+
+	if (size <= pool->ip_bufsize && pool->ip_nbufs > 0) {
+		cpu = curcpu;
+		for (i = 0; i <= mp_maxid; i++) {
+			pc = &pool->ip_cpu[(cpu + i) % (mp_maxid + 1)];
+			if (SLIST_EMPTY(&pc->ip_free))
+				continue;
+			mtx_lock(&pc->ip_lock);
+			ib = SLIST_FIRST(&pc->ip_free);
+			if (ib != NULL)
+				SLIST_REMOVE_HEAD(&pc->ip_free, ib_link);
+			mtx_unlock(&pc->ip_lock);
+			if (ib != NULL) {
+				counter_u64_add(vboxfs_iobuf_hits, 1);
+				return (ib);
+			}
+		}
+	}
+
+	counter_u64_add(vboxfs_iobuf_misses, 1);
+	ib = malloc(sizeof(*ib), M_VBOXVFS, M_WAITOK | M_ZERO);
+	ib->ib_data = malloc(size, M_VBOXVFS, M_WAITOK);
+	ib->ib_size = size;
+	return (ib);
+}
+
+void
+vboxfs_iobuf_put(struct vboxfs_mnt *vboxfsmp, struct vboxfs_iobuf *ib)
+{
+	struct vboxfs_iopool_cpu *pc;
+
+	if (!ib->ib_pooled) {
+		free(ib->ib_data, M_VBOXVFS);
+		free(ib, M_VBOXVFS);
+		return;
+	}
+
+	pc = &vboxfsmp->sf_iopool.ip_cpu[curcpu];
+	mtx_lock(&pc->ip_lock);
+	SLIST_INSERT_HEAD(&pc->ip_free, ib, ib_link);
+	mtx_unlock(&pc->ip_lock);
+}
+
 static int
 vboxfs_cmount(struct mntarg *ma, void *data, uint64_t flags)
 {
@@ -195,6 +604,22 @@ static const char *vboxfs_opts[] = {
 	"gid",
 	"file_mode",
 	"dir_mode",
+	"iosize",
+	"iobufs",
+	"dirttl",
+	"negttl",
+	"acregmin",
+	"acregmax",
+	"acdirmin",
+	"acdirmax",
+	"consistency",
+	"immutable",
+	"index",
+	"prefetch",
+	"prefetchmax",
+	"writeback",
+	"nofsync",
+	"casesensitive",
 	"errmsg",
 	NULL
 };
@@ -243,6 +668,7 @@ vboxfs_node_init(void *mem, int size, int flags)
 	node->sf_ino = 0;
 
 	mtx_init(&node->sf_interlock, "tmpfs node interlock", NULL, MTX_DEF);
+	sx_init(&node->sf_dir_lock, "vboxfs dir listing");
 
 	return (0);
 }
@@ -253,6 +679,46 @@ vboxfs_node_fini(void *mem, int size)
 	struct vboxfs_node *node = (struct vboxfs_node *)mem;
 
 	mtx_destroy(&node->sf_interlock);
+	sx_destroy(&node->sf_dir_lock);
+}
+
+/*
+ * Pick the transfer size for host reads and writes: a whole number of
+ * host allocation units, no larger than the requested (or default) limit.
+ */
+static uint32_t
+vboxfs_negotiate_iosize(sffs_fsinfo_t *fsinfo, u_int maxio)
+{
+	uint32_t unit, iosize;
+
+	unit = fsinfo->blksize;
+	if (unit < PAGE_SIZE || unit > VBOXFS_MAX_IOSIZE)
+		unit = PAGE_SIZE;
+	unit = round_page(unit);
+
+	if (maxio == 0)
+		maxio = VBOXFS_DEF_IOSIZE;
+	maxio = MIN(maxio, VBOXFS_MAX_IOSIZE);
+
+	iosize = rounddown(maxio, unit);
+	if (iosize < unit)
+		iosize = unit;
+	return (iosize);
+}
+
+/*
+ * Pick the block size of the buffer cache: the largest power of two that
+ * fits both in a host transfer and in a buffer.
+ */
+static u_int
+vboxfs_negotiate_bsize(uint32_t iosize)
+{
+	u_int bsize;
+
+	for (bsize = PAGE_SIZE; bsize * 2 <= MIN(iosize, MAXBSIZE);
+	    bsize *= 2)
+		;
+	return (bsize);
 }
 
 static int
@@ -268,6 +734,17 @@ vboxfs_mount(struct mount *mp)
    	mode_t file_mode = 0, dir_mode = 0;
 	uid_t uid = 0;
 	gid_t gid = 0;
+	u_int iosize = 0;
+	u_int iobufs = VBOXFS_DEF_IOBUFS;
+	int dirttl = -1;
+	int negttl = -1;
+	int acregmin = VBOXFS_DEF_ACMIN, acregmax = VBOXFS_DEF_ACMAX;
+	int acdirmin = VBOXFS_DEF_ACMIN, acdirmax = VBOXFS_DEF_ACMAX;
+	int consistency = VBOXFS_CONS_STRICT;
+	int prefetch = 0;
+	u_int prefetchmax = VBOXFS_DEF_PREFETCHMAX;
+	int immutable;
+	char *cons, *ixfile;
 	struct vboxfs_node *root;
 
 	if (mp->mnt_flag & (MNT_UPDATE | MNT_ROOTFS))
@@ -283,6 +760,53 @@ vboxfs_mount(struct mount *mp)
 	VBOX_INTOPT("file_mode", file_mode, 8);
 	VBOX_INTOPT("dir_mode", dir_mode, 8);
 	VBOX_INTOPT("ro", readonly, 10);
+	VBOX_INTOPT("iosize", iosize, 10);
+	VBOX_INTOPT("iobufs", iobufs, 10);
+	VBOX_INTOPT("dirttl", dirttl, 10);
+	VBOX_INTOPT("negttl", negttl, 10);
+	VBOX_INTOPT("acregmin", acregmin, 10);
+	VBOX_INTOPT("acregmax", acregmax, 10);
+	VBOX_INTOPT("acdirmin", acdirmin, 10);
+	VBOX_INTOPT("acdirmax", acdirmax, 10);
+	VBOX_INTOPT("prefetch", prefetch, 10);
+	VBOX_INTOPT("prefetchmax", prefetchmax, 10);
+	if (iobufs > VBOXFS_MAX_IOBUFS)
+		iobufs = VBOXFS_MAX_IOBUFS;
+	if (prefetchmax > VBOXFS_MAX_PREFETCHMAX)
+		prefetchmax = VBOXFS_MAX_PREFETCHMAX;
+
+	/*
+	 * An immutable mount is read-only, see vboxvfs_index.c.  Keeping
+	 * its index in a file implies it.
+	 */
+	ixfile = vfs_getopts(opts, "index", &error);
+	if ((error != 0 && error != ENOENT) ||
+	    (ixfile != NULL && ixfile[0] != '/')) {
+		vfs_mount_error(mp, "Invalid index");
+		return (EINVAL);
+	}
+	immutable = vfs_flagopt(opts, "immutable", NULL, 0) || ixfile != NULL;
+	if (immutable)
+		readonly = 1;
+
+	error = 0;
+	cons = vfs_getopts(opts, "consistency", &error);
+	if (error == ENOENT)
+		error = 0;
+	else if (cons != NULL) {
+		if (strcmp(cons, "strict") == 0)
+			consistency = VBOXFS_CONS_STRICT;
+		else if (strcmp(cons, "cto") == 0)
+			consistency = VBOXFS_CONS_CTO;
+		else if (strcmp(cons, "relaxed") == 0)
+			consistency = VBOXFS_CONS_RELAXED;
+		else
+			error = EINVAL;
+	}
+	if (error != 0) {
+		vfs_mount_error(mp, "Invalid consistency");
+		return (EINVAL);
+	}
 
 	error = vfs_getopt(opts, "from", (void **)&share_name, &share_len);
 	if (error != 0 || share_len == 0) {
@@ -295,8 +819,18 @@ vboxfs_mount(struct mount *mp)
 	vboxfsmp->sf_gid = gid;
 	vboxfsmp->sf_fmode = file_mode & (S_IRWXU | S_IRWXG | S_IRWXO);
 	vboxfsmp->sf_dmode = dir_mode & (S_IRWXU | S_IRWXG | S_IRWXO);
-	vboxfsmp->sf_ino = 3;
-	vboxfsmp->sf_stat_ttl = 200;
+	vboxfsmp->sf_acregmin = MAX(acregmin, 0);
+	vboxfsmp->sf_acregmax = MAX(acregmax, vboxfsmp->sf_acregmin);
+	vboxfsmp->sf_acdirmin = MAX(acdirmin, 0);
+	vboxfsmp->sf_acdirmax = MAX(acdirmax, vboxfsmp->sf_acdirmin);
+	vboxfsmp->sf_dir_ttl = (dirttl >= 0) ? dirttl : vboxfsmp->sf_acdirmin;
+	vboxfsmp->sf_neg_ttl = (negttl >= 0) ? negttl : vboxfsmp->sf_acdirmin;
+	vboxfsmp->sf_consistency = consistency;
+	vboxfsmp->sf_prefetch_depth = prefetch;
+	vboxfsmp->sf_prefetch_max = prefetchmax;
+	vboxfsmp->sf_writeback = vfs_flagopt(opts, "writeback", NULL, 0);
+	vboxfsmp->sf_fsync = !vfs_flagopt(opts, "nofsync", NULL, 0);
+	vboxfsmp->sf_casesens = vfs_flagopt(opts, "casesensitive", NULL, 0);
 
 	/* Invoke Hypervisor mount interface before proceeding */
 	error = sfprov_mount(share_name, &handle);
@@ -311,10 +845,29 @@ vboxfs_mount(struct mount *mp)
 	}
 	if (readonly == 0)
 		readonly = (fsinfo.readonly != 0);
+	if (immutable) {
+		error = vboxfs_index_build(handle, share_name, ixfile,
+		    &vboxfsmp->sf_index);
+		if (error != 0) {
+			vfs_mount_error(mp, "Cannot index the share");
+			sfprov_unmount(handle);
+			free(vboxfsmp, M_VBOXVFS);
+			return (error);
+		}
+	}
+	vboxfsmp->sf_iosize = vboxfs_negotiate_iosize(&fsinfo, iosize);
+	vboxfs_iopool_init(vboxfsmp, vboxfsmp->sf_iosize, iobufs);
+	vboxfsmp->sf_bsize = vboxfs_negotiate_bsize(vboxfsmp->sf_iosize);
 
 	vboxfsmp->sf_handle = handle;
 	vboxfsmp->sf_vfsp = mp;
 
+	vboxfsmp->sf_hashtbl = hashinit(desiredvnodes / 4, M_VBOXVFS,
+	    &vboxfsmp->sf_hashmask);
+	vboxfsmp->sf_inohashtbl = hashinit(desiredvnodes / 4, M_VBOXVFS,
+	    &vboxfsmp->sf_inohashmask);
+	rw_init(&vboxfsmp->sf_hashlock, "vboxfs node hash");
+
 	vboxfsmp->sf_node_pool = uma_zcreate("VBOXFS node",
 	    sizeof(struct vboxfs_node),
 	    vboxfs_node_ctor, vboxfs_node_dtor,
@@ -327,12 +880,25 @@ vboxfs_mount(struct mount *mp)
 
 	if (error != 0 || root == NULL) {
 		uma_zdestroy(vboxfsmp->sf_node_pool);
+		rw_destroy(&vboxfsmp->sf_hashlock);
+		hashdestroy(vboxfsmp->sf_hashtbl, M_VBOXVFS,
+		    vboxfsmp->sf_hashmask);
+		hashdestroy(vboxfsmp->sf_inohashtbl, M_VBOXVFS,
+		    vboxfsmp->sf_inohashmask);
+		vboxfs_iopool_destroy(vboxfsmp);
+		if (vboxfsmp->sf_index != NULL)
+			vboxfs_index_free(vboxfsmp->sf_index);
 		free(vboxfsmp, M_VBOXVFS);
 		return error;
 	}
 
 	root->sf_parent = root;
 	vboxfsmp->sf_root = root;
+	if (vboxfsmp->sf_index != NULL) {
+		root->sf_ient = 0;
+		(void) vboxfs_index_stat(vboxfsmp->sf_index, 0,
+		    &root->sf_stat);
+	}
 
 	MNT_ILOCK(mp);
 	mp->mnt_data = vboxfsmp;
@@ -340,6 +906,9 @@ vboxfs_mount(struct mount *mp)
 	/* f_fsid is int32_t but serial is uint32_t, convert */
 	memcpy(&mp->mnt_stat.f_fsid, &fsinfo.serial, sizeof(mp->mnt_stat.f_fsid));
 	mp->mnt_flag |= MNT_LOCAL;
+	/* Read clusters are sent to the host as single transfers. */
+	mp->mnt_stat.f_iosize = vboxfsmp->sf_bsize;
+	mp->mnt_iosize_max = MIN(vboxfsmp->sf_iosize, MAXPHYS);
 	if (readonly != 0)
 		mp->mnt_flag |= MNT_RDONLY;
 #if __FreeBSD_version >= 1000021
@@ -351,6 +920,8 @@ vboxfs_mount(struct mount *mp)
 	MNT_IUNLOCK(mp);
 	vfs_mountedfrom(mp, share_name);
 
+	vboxfs_prefetch_start(vboxfsmp);
+
 	return (0);
 }
 
@@ -378,13 +949,26 @@ vboxfs_unmount(struct mount *mp, int mntflags)
 	if (error)
 		return (error);
 
+	/* The prefetch thread makes host calls and holds nodes. */
+	vboxfs_prefetch_stop(vboxfsmp);
+
 	/* Invoke Hypervisor unmount interface before proceeding */
 	error = sfprov_unmount(vboxfsmp->sf_handle);
 	if (error != 0) {
 		/* TBD anything here? */
 	}
 
+	/* Drop the mount's reference on the root; every other node is gone. */
+	vboxfs_node_rele(vboxfsmp, vboxfsmp->sf_root);
+
 	uma_zdestroy(vboxfsmp->sf_node_pool);
+	rw_destroy(&vboxfsmp->sf_hashlock);
+	hashdestroy(vboxfsmp->sf_hashtbl, M_VBOXVFS, vboxfsmp->sf_hashmask);
+	hashdestroy(vboxfsmp->sf_inohashtbl, M_VBOXVFS,
+	    vboxfsmp->sf_inohashmask);
+	vboxfs_iopool_destroy(vboxfsmp);
+	if (vboxfsmp->sf_index != NULL)
+		vboxfs_index_free(vboxfsmp->sf_index);
 
 	free(vboxfsmp, M_VBOXVFS);
 	MNT_ILOCK(mp);
@@ -426,12 +1010,26 @@ vboxfs_init(struct vfsconf *vfsp)
 
 	DROP_GIANT();
 
+	vboxfs_iobuf_hits = counter_u64_alloc(M_WAITOK);
+	vboxfs_iobuf_misses = counter_u64_alloc(M_WAITOK);
+	vboxfs_neg_hits = counter_u64_alloc(M_WAITOK);
+	vboxfs_neg_expired = counter_u64_alloc(M_WAITOK);
+	vboxfs_prefetch_dirs = counter_u64_alloc(M_WAITOK);
+
 	sfprov = sfprov_connect(SFPROV_VERSION);
 	if (sfprov == NULL) {
 		printf("%s: couldn't connect to sf provider", __func__);
 		return (ENODEV);
 	}
 
+	vboxfs_rio_tq = taskqueue_create("vboxfs rio", M_WAITOK,
+	    taskqueue_thread_enqueue, &vboxfs_rio_tq);
+	taskqueue_start_threads(&vboxfs_rio_tq, VBOXFS_RIO_THREADS, PVFS,
+	    "vboxfs rio");
+
+	vboxfs_lowmem_tag = EVENTHANDLER_REGISTER(vm_lowmem,
+	    vboxfs_dir_lowmem, NULL, EVENTHANDLER_PRI_FIRST);
+
 	error = sfprov_set_show_symlinks();
 	if (error != 0)
 		printf("%s: host unable to show symlinks, error=%d\n",
@@ -450,6 +1048,13 @@ vboxfs_uninit(struct vfsconf *vfsp)
 
 	DROP_GIANT();
 	sfprov_disconnect();
+	EVENTHANDLER_DEREGISTER(vm_lowmem, vboxfs_lowmem_tag);
+	counter_u64_free(vboxfs_iobuf_hits);
+	counter_u64_free(vboxfs_iobuf_misses);
+	counter_u64_free(vboxfs_neg_hits);
+	counter_u64_free(vboxfs_neg_expired);
+	counter_u64_free(vboxfs_prefetch_dirs);
+	taskqueue_free(vboxfs_rio_tq);
 	PICKUP_GIANT();
 	return (0);
 }
@@ -470,7 +1075,7 @@ vboxfs_statfs(struct mount *mp, struct statfs *sbp)
 	if (error != 0)
 		return (error);
 
-	sbp->f_iosize = fsinfo.blksize;
+	sbp->f_iosize = vboxfsmp->sf_bsize;
 	sbp->f_bsize = fsinfo.blksize;
 
 	sbp->f_bfree = fsinfo.blksavail;
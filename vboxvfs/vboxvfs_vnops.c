@@ -26,10 +26,45 @@
 #include <sys/queue.h>
 #include <sys/unistd.h>
 #include <sys/endian.h>
-
+#include <sys/fnv_hash.h>
+#include <sys/proc.h>
+#include <sys/uio.h>
+#include <sys/lock.h>
+#include <sys/rwlock.h>
+#include <sys/sx.h>
+#include <sys/sysctl.h>
+#include <sys/counter.h>
+#include <sys/kthread.h>
+#include <sys/mutex.h>
+#include <sys/sched.h>
+#include <sys/sf_buf.h>
+#include <sys/taskqueue.h>
+#include <sys/vmmeter.h>
+
+#include <vm/vm.h>
+#include <vm/vm_extern.h>
+#include <vm/vm_map.h>
+#include <vm/vm_object.h>
+#include <vm/vm_page.h>
+#include <vm/vm_pager.h>
+#include <vm/vnode_pager.h>
+#include <vm/pmap.h>
 #include <vm/uma.h>
 
 #include "vboxvfs.h"
+#include "vboxvfs_ra.h"
+
+SYSCTL_DECL(_vfs_vboxfs);
+
+static u_int vboxfs_dir_maxbufs = 128;
+SYSCTL_UINT(_vfs_vboxfs, OID_AUTO, dir_maxbufs, CTLFLAG_RW,
+    &vboxfs_dir_maxbufs, 0,
+    "Listing buffers kept per directory before read ones are freed (0: all)");
+
+static int vboxfs_readahead = 32;
+SYSCTL_INT(_vfs_vboxfs, OID_AUTO, readahead, CTLFLAG_RW,
+    &vboxfs_readahead, 0,
+    "Most blocks read ahead of a sequential reader (0: none)");
 
 /*
  * Prototypes for VBOXVFS vnode operations
@@ -43,9 +78,14 @@ static vop_setattr_t	vboxfs_setattr;
 static vop_read_t	vboxfs_read;
 static vop_readlink_t	vboxfs_readlink;
 static vop_write_t	vboxfs_write;
+static vop_strategy_t	vboxfs_strategy;
+static vop_bmap_t	vboxfs_bmap;
+static vop_getpages_t	vboxfs_getpages;
+static vop_putpages_t	vboxfs_putpages;
 static vop_fsync_t	vboxfs_fsync;
 static vop_remove_t	vboxfs_remove;
 static vop_link_t	vboxfs_link;
+static vop_lookup_t	vboxfs_cache_lookup;
 static vop_cachedlookup_t	vboxfs_lookup;
 static vop_rename_t	vboxfs_rename;
 static vop_mkdir_t	vboxfs_mkdir;
@@ -70,16 +110,18 @@ struct vop_vector vboxfs_vnodeops = {
 	.vop_fsync	= vboxfs_fsync,
 	.vop_getattr	= vboxfs_getattr,
 	.vop_getextattr = VOP_EOPNOTSUPP,
+	.vop_getpages	= vboxfs_getpages,
 	.vop_inactive	= vboxfs_inactive,
 	.vop_ioctl	= vboxfs_ioctl,
 	.vop_link	= vboxfs_link,
-	.vop_lookup	= vfs_cache_lookup,
+	.vop_lookup	= vboxfs_cache_lookup,
 	.vop_cachedlookup	= vboxfs_lookup,
 	.vop_mkdir	= vboxfs_mkdir,
 	.vop_mknod	= VOP_EOPNOTSUPP,
 	.vop_open	= vboxfs_open,
 	.vop_pathconf	= vboxfs_pathconf,
 	.vop_print	= vboxfs_print,
+	.vop_putpages	= vboxfs_putpages,
 	.vop_read	= vboxfs_read,
 	.vop_readdir	= vboxfs_readdir,
 	.vop_readlink	= vboxfs_readlink,
@@ -88,44 +130,111 @@ struct vop_vector vboxfs_vnodeops = {
 	.vop_rename	= vboxfs_rename,
 	.vop_rmdir	= vboxfs_rmdir,
 	.vop_setattr	= vboxfs_setattr,
+	.vop_strategy	= vboxfs_strategy,
 	.vop_vptofh 	= vboxfs_vptofh,
 	.vop_symlink	= vboxfs_symlink,
 	.vop_write	= vboxfs_write,
-	.vop_bmap	= VOP_EOPNOTSUPP
+	.vop_bmap	= vboxfs_bmap
 };
 
+/*
+ * Cache timestamps come from the uptime clock, so setting the time of
+ * day neither expires nor extends cached data.
+ */
 static uint64_t
 vsfnode_cur_time_usec(void)
 {
 	struct timeval now;
 
-	getmicrotime(&now);
+	getmicrouptime(&now);
+
+	return ((uint64_t)now.tv_sec * 1000000 + now.tv_usec);
+}
+
+/*
+ * The same to the microsecond, for timing host calls.
+ */
+static uint64_t
+vsfnode_precise_time_usec(void)
+{
+	struct timeval now;
+
+	microuptime(&now);
 
-	return (now.tv_sec*1000 + now.tv_usec);
+	return ((uint64_t)now.tv_sec * 1000000 + now.tv_usec);
 }
 
+/*
+ * On an immutable mount sf_stat is set from the index when the node is
+ * looked up, and never goes stale.
+ */
 static int
 vsfnode_stat_cached(struct vboxfs_node *np)
 {
+	if (np->vboxfsmp->sf_index != NULL)
+		return (1);
 	return (vsfnode_cur_time_usec() - np->sf_stat_time) <
-	    np->vboxfsmp->sf_stat_ttl * 1000UL;
+	    np->sf_stat_ttl * 1000UL;
 }
 
+/*
+ * Refetch the node's attributes and adapt how long they are trusted, in
+ * the spirit of the NFS attribute cache: every refresh finding the host
+ * mtime and ctime unchanged doubles the node's ttl up to the mount's
+ * acregmax or acdirmax, and a change drops it back to the minimum.
+ */
 static int
 vsfnode_update_stat_cache(struct vboxfs_node *np)
 {
-	int error;
+	struct vboxfs_mnt *vboxfsmp = np->vboxfsmp;
+	struct timespec mtime, ctime;
+	sffs_stat_t stat;
+	int error, acmin, acmax;
+
+	if (vboxfsmp->sf_index != NULL) {
+		error = vboxfs_index_stat(vboxfsmp->sf_index, np->sf_ient,
+		    &stat);
+		if (error == 0) {
+			VBOXFS_NODE_LOCK(np);
+			np->sf_stat = stat;
+			VBOXFS_NODE_UNLOCK(np);
+		}
+		return (error);
+	}
 
-	error = sfprov_get_attr(np->vboxfsmp->sf_handle, np->sf_path,
-	    &np->sf_stat);
+	error = sfprov_get_attr(vboxfsmp->sf_handle, np->sf_spath, &stat);
 #if 0
 	if (error == ENOENT)
 		sfnode_make_stale(node);
 #endif
-	if (error == 0)
-		np->sf_stat_time = vsfnode_cur_time_usec();
+	if (error != 0)
+		return (error);
+
+	VBOXFS_NODE_LOCK(np);
+	mtime = np->sf_stat.sf_mtime;
+	ctime = np->sf_stat.sf_ctime;
+	np->sf_stat = stat;
+	/* Buffered writes extend the file before the host knows. */
+	if (np->sf_stat.sf_size < np->sf_wsize)
+		np->sf_stat.sf_size = np->sf_wsize;
+	VBOXFS_NODE_UNLOCK(np);
+
+	if (np->sf_type == VDIR) {
+		acmin = vboxfsmp->sf_acdirmin;
+		acmax = vboxfsmp->sf_acdirmax;
+	} else {
+		acmin = vboxfsmp->sf_acregmin;
+		acmax = vboxfsmp->sf_acregmax;
+	}
+	if (np->sf_stat_time != 0 &&
+	    timespeccmp(&np->sf_stat.sf_mtime, &mtime, ==) &&
+	    timespeccmp(&np->sf_stat.sf_ctime, &ctime, ==))
+		np->sf_stat_ttl = MIN(MAX(np->sf_stat_ttl * 2, 1), acmax);
+	else
+		np->sf_stat_ttl = acmin;
+	np->sf_stat_time = vsfnode_cur_time_usec();
 
-	return (error);
+	return (0);
 }
 
 /*
@@ -240,6 +349,7 @@ loop1:
 
 	vp->v_data = node;
 	vp->v_type = node->sf_type;
+	vp->v_bufobj.bo_bsize = node->vboxfsmp->sf_bsize;
 
 	/* Type-specific initialization. */
 	switch (node->sf_type) {
@@ -273,6 +383,10 @@ loop1:
 		vp = NULL;
 
 unlock:
+	/* The vnode holds a node reference until vboxfs_reclaim(). */
+	if (vp != NULL)
+		vboxfs_node_hold(node);
+
 	VBOXFS_NODE_LOCK(node);
 
 	MPASS(node->sf_vpstate & VBOXFS_VNODE_ALLOCATING);
@@ -321,27 +435,56 @@ vboxfs_free_vp(struct vnode *vp)
 }
 
 /*
- * Allocate new vboxfs_node and vnode for given file
+ * Get a referenced node for the given file, allocating a new vboxfs_node
+ * for it unless a live node for the same name is found in the node hash.
  */
 static int
-vboxfs_alloc_file(struct vboxfs_mnt *vboxfsmp, const char *fullpath,
+vboxfs_get_node(struct vboxfs_mnt *vboxfsmp, const char *fullpath,
     enum vtype type, mode_t mode, struct vboxfs_node *parent,
-    int lkflag, struct vnode **vpp)
+    struct vboxfs_node **npp)
 {
 	int error;
-	struct vboxfs_node *unode;
+	struct vboxfs_node *unode, *np;
 
 	error = vboxfs_alloc_node(vboxfsmp->sf_vfsp, vboxfsmp, fullpath, type,
 	    vboxfsmp->sf_uid, vboxfsmp->sf_gid, mode, parent, &unode);
 
 	if (error)
-		goto out;
+		return (error);
 
-	error = vboxfs_alloc_vp(vboxfsmp->sf_vfsp, unode, lkflag, vpp);
-	if (error)
-		vboxfs_free_node(vboxfsmp, unode);
+	while ((np = vboxfs_node_insert(vboxfsmp, unode)) != unode) {
+		/*
+		 * Someone else entered this name first.  Use their node
+		 * unless the host object was replaced by one of another
+		 * type, in which case the old node is stale.
+		 */
+		if (np->sf_type == type) {
+			vboxfs_node_rele(vboxfsmp, unode);
+			break;
+		}
+		vboxfs_node_unhash(vboxfsmp, np);
+		vboxfs_node_rele(vboxfsmp, np);
+	}
+	*npp = np;
+	return (0);
+}
 
-out:
+/*
+ * Get the vnode for given file, see vboxfs_get_node().
+ */
+static int
+vboxfs_alloc_file(struct vboxfs_mnt *vboxfsmp, const char *fullpath,
+    enum vtype type, mode_t mode, struct vboxfs_node *parent,
+    int lkflag, struct vnode **vpp)
+{
+	struct vboxfs_node *np;
+	int error;
+
+	error = vboxfs_get_node(vboxfsmp, fullpath, type, mode, parent, &np);
+	if (error != 0)
+		return (error);
+	error = vboxfs_alloc_vp(vboxfsmp->sf_vfsp, np, lkflag, vpp);
+	vboxfs_node_rele(vboxfsmp, np);
 	return (error);
 }
 
@@ -355,21 +498,27 @@ vboxfs_vn_get_ino_alloc(struct mount *mp, void *arg, int lkflags,
 
 /*
  * Construct a new pathname given an sfnode plus an optional tail
- * component of length len
+ * component of length len, in a scratch string the caller releases with
+ * sfprov_path_put().
  * This handles ".." and "."
  */
-static char *
-sfnode_construct_path(struct vboxfs_node *node, char *tail, int len)
+static int
+sfnode_construct_path(struct vboxfs_node *node, char *tail, int len,
+    SHFLSTRING **pathp)
 {
-	char *p;
+	SHFLSTRING *p;
+	int error;
 
 	if (strncmp(tail, ".", len) == 0 || strncmp(tail, "..", len) == 0)
 		panic("construct path for %s", tail);
-	p = malloc(strlen(node->sf_path) + 1 + len + 1, M_VBOXVFS, M_WAITOK);
-	strcpy(p, node->sf_path);
-	strcat(p, "/");
-	strncat(p, tail, len);
-	return (p);
+	p = sfprov_path_get();
+	error = sfprov_path_child(p, node->sf_spath, tail, len);
+	if (error != 0) {
+		sfprov_path_put(p);
+		p = NULL;
+	}
+	*pathp = p;
+	return (error);
 }
 
 static int
@@ -408,16 +557,468 @@ vboxfs_access(struct vop_access_args *ap)
 }
 
 /*
- * Clears the (cached) directory listing for the node.
+ * Directories holding a listing, so that listings can be given back
+ * under memory pressure.  Lock order is node sf_dir_lock, then
+ * vboxfs_dir_lock; vboxfs_dir_lowmem() only try-locks nodes.
  */
+static struct sx vboxfs_dir_lock;
+SX_SYSINIT(vboxfs_dir_lock, &vboxfs_dir_lock, "vboxfs listed dirs");
+static LIST_HEAD(, vboxfs_node) vboxfs_dir_nodes =
+    LIST_HEAD_INITIALIZER(vboxfs_dir_nodes);
+
 static void
-vfsnode_clear_dir_list(struct vboxfs_node *np)
+vfsnode_free_dir_list(struct vboxfs_node *np)
 {
+	sx_assert(&np->sf_dir_lock, SA_XLOCKED);
 	while (np->sf_dir_list != NULL) {
 		sffs_dirents_t *next = np->sf_dir_list->sf_next;
 		free(np->sf_dir_list, M_VBOXVFS);
 		np->sf_dir_list = next;
 	}
+	if (np->sf_dir_vec != NULL)
+		free(np->sf_dir_vec, M_VBOXVFS);
+	if (np->sf_dir_index != NULL)
+		free(np->sf_dir_index, M_VBOXVFS);
+	np->sf_dir_index = NULL;
+	np->sf_dir_indexmask = 0;
+	np->sf_children = 0;
+	np->sf_dir_vec = NULL;
+	np->sf_dir_nvec = 0;
+	np->sf_dir_vecsize = 0;
+	np->sf_dir_first = 0;
+	np->sf_dir_tail = NULL;
+	np->sf_dir_time = 0;
+}
+
+/*
+ * Clears the (cached) directory listing for the node.
+ */
+static void
+vfsnode_clear_dir_list_locked(struct vboxfs_node *np)
+{
+	sx_assert(&np->sf_dir_lock, SA_XLOCKED);
+	if (np->sf_dir_listed) {
+		sx_xlock(&vboxfs_dir_lock);
+		LIST_REMOVE(np, sf_dir_link);
+		np->sf_dir_listed = 0;
+		sx_xunlock(&vboxfs_dir_lock);
+	}
+	if (np->sf_dir_stream != NULL) {
+		sfprov_readdir_close(np->sf_dir_stream);
+		np->sf_dir_stream = NULL;
+	}
+	vfsnode_free_dir_list(np);
+}
+
+void
+vfsnode_clear_dir_list(struct vboxfs_node *np)
+{
+	sx_xlock(&np->sf_dir_lock);
+	vfsnode_clear_dir_list_locked(np);
+	sx_xunlock(&np->sf_dir_lock);
+}
+
+/*
+ * vm_lowmem handler: drop every complete listing not in use.  Listings
+ * still streaming from the host are left alone, closing their host
+ * handle would mean a host call with vboxfs_dir_lock held.
+ */
+void
+vboxfs_dir_lowmem(void *arg __unused, int flags __unused)
+{
+	struct vboxfs_node *np, *tnp;
+
+	sx_xlock(&vboxfs_dir_lock);
+	LIST_FOREACH_SAFE(np, &vboxfs_dir_nodes, sf_dir_link, tnp) {
+		if (!sx_try_xlock(&np->sf_dir_lock))
+			continue;
+		if (np->sf_dir_stream == NULL) {
+			LIST_REMOVE(np, sf_dir_link);
+			np->sf_dir_listed = 0;
+			vfsnode_free_dir_list(np);
+		}
+		sx_xunlock(&np->sf_dir_lock);
+	}
+	sx_xunlock(&vboxfs_dir_lock);
+}
+
+/*
+ * Whether the listing still matches the host directory.  It is trusted
+ * for sf_dir_ttl after it was fetched or last checked; after that the
+ * directory's host mtime and ctime are compared with those it had when
+ * the listing was fetched, which costs one attribute call instead of a
+ * new listing.
+ */
+static int
+vsfnode_dir_fresh(struct vboxfs_node *np)
+{
+
+	sx_assert(&np->sf_dir_lock, SA_LOCKED);
+	return (np->sf_dir_time != 0 && vsfnode_cur_time_usec() -
+	    np->sf_dir_checked < np->vboxfsmp->sf_dir_ttl * 1000UL);
+}
+
+static int
+vsfnode_dir_valid(struct vboxfs_node *np)
+{
+	uint64_t now;
+
+	sx_assert(&np->sf_dir_lock, SA_XLOCKED);
+	if (np->sf_dir_time == 0)
+		return (0);
+	if (vsfnode_dir_fresh(np))
+		return (1);
+	now = vsfnode_cur_time_usec();
+	if (vsfnode_update_stat_cache(np) != 0 ||
+	    !timespeccmp(&np->sf_stat.sf_mtime, &np->sf_dir_mtime, ==) ||
+	    !timespeccmp(&np->sf_stat.sf_ctime, &np->sf_dir_ctime, ==))
+		return (0);
+	np->sf_dir_checked = now;
+	return (1);
+}
+
+/*
+ * The listing is recent enough to answer for its entries' attributes.
+ */
+static int
+vsfnode_dir_cached(struct vboxfs_node *np)
+{
+	sx_assert(&np->sf_dir_lock, SA_LOCKED);
+	return (np->sf_dir_time != 0 &&
+	    (vsfnode_cur_time_usec() - np->sf_dir_time) <
+	    np->vboxfsmp->sf_acregmin * 1000UL);
+}
+
+/*
+ * Index the names of a complete listing, so lookups in the directory
+ * can be answered from it.  The table is open addressed and kept at
+ * most half full.
+ */
+static void
+vsfnode_dir_index(struct vboxfs_node *dir)
+{
+	struct sffs_dirslot *slot;
+	sffs_dirents_t *cur_buf;
+	struct dirent *dirent;
+	uint32_t hash, nents;
+	u_int i, mask, size;
+	int j;
+
+	sx_assert(&dir->sf_dir_lock, SA_XLOCKED);
+	MPASS(dir->sf_dir_stream == NULL && dir->sf_dir_index == NULL);
+
+	/* Entries may already have been trimmed from a huge listing. */
+	if (dir->sf_dir_first != 0)
+		return;
+	nents = 0;
+	for (cur_buf = dir->sf_dir_list; cur_buf != NULL;
+	    cur_buf = cur_buf->sf_next)
+		nents += cur_buf->sf_nents;
+	for (size = 16; size < nents * 2; size <<= 1)
+		;
+	mask = size - 1;
+	dir->sf_dir_index = malloc(size * sizeof(*slot), M_VBOXVFS,
+	    M_WAITOK | M_ZERO);
+	dir->sf_dir_indexmask = mask;
+	dir->sf_children = nents;
+
+	for (i = 0; i < dir->sf_dir_nvec; i++) {
+		cur_buf = dir->sf_dir_vec[i];
+		dirent = (struct dirent *)&cur_buf->sf_entries[0];
+		for (j = 0; j < cur_buf->sf_nents; j++,
+		    dirent = (struct dirent *)
+		    ((char *)dirent + dirent->d_reclen)) {
+			hash = fnv_32_buf(dirent->d_name, dirent->d_namlen,
+			    FNV1_32_INIT);
+			for (slot = &dir->sf_dir_index[hash & mask];
+			    slot->ds_cookie != 0;
+			    slot = &dir->sf_dir_index[(slot -
+			    dir->sf_dir_index + 1) & mask])
+				;
+			slot->ds_hash = hash;
+			slot->ds_rec = j;
+			slot->ds_cookie = (off_t)i * SFFS_DIRENTS_SIZE +
+			    ((char *)dirent - cur_buf->sf_entries) + 1;
+		}
+	}
+}
+
+/*
+ * Look 'name' up in the directory's name index.  While the listing is
+ * complete and still valid, a name found there comes back as 0, with
+ * the entry's attributes and their age in *statp and *timep.  A name
+ * not there is ENOENT only on casesensitive mounts: elsewhere the host
+ * may know it under another case.  EJUSTRETURN means the host has to be
+ * asked, either because there is no usable listing or because the
+ * attributes it carries are older than the stat TTL.
+ *
+ * The index is probed under the shared lock, so lookups in a directory
+ * run in parallel; the exclusive lock is only taken when the listing
+ * is due to be checked against the host.
+ */
+static int
+vsfnode_dir_lookup(struct vboxfs_node *dir, const char *name, int namelen,
+    sffs_stat_t *statp, uint64_t *timep)
+{
+	struct sffs_dirslot *slot;
+	sffs_dirents_t *cur_buf;
+	struct dirent *dirent;
+	uint32_t hash;
+	u_int mask;
+	off_t cookie;
+	int error;
+
+	error = EJUSTRETURN;
+	sx_slock(&dir->sf_dir_lock);
+	if (dir->sf_dir_index == NULL)
+		goto out;
+	if (!vsfnode_dir_fresh(dir)) {
+		if (!sx_try_upgrade(&dir->sf_dir_lock)) {
+			sx_sunlock(&dir->sf_dir_lock);
+			sx_xlock(&dir->sf_dir_lock);
+		}
+		if (dir->sf_dir_index != NULL && !vsfnode_dir_valid(dir))
+			vfsnode_clear_dir_list_locked(dir);
+		sx_downgrade(&dir->sf_dir_lock);
+		if (dir->sf_dir_index == NULL)
+			goto out;
+	}
+	hash = fnv_32_buf(name, namelen, FNV1_32_INIT);
+	mask = dir->sf_dir_indexmask;
+	if (dir->vboxfsmp->sf_casesens)
+		error = ENOENT;
+	for (slot = &dir->sf_dir_index[hash & mask]; slot->ds_cookie != 0;
+	    slot = &dir->sf_dir_index[(slot - dir->sf_dir_index + 1) & mask]) {
+		if (slot->ds_hash != hash)
+			continue;
+		cookie = slot->ds_cookie - 1;
+		cur_buf = dir->sf_dir_vec[cookie / SFFS_DIRENTS_SIZE];
+		dirent = (struct dirent *)
+		    &cur_buf->sf_entries[cookie % SFFS_DIRENTS_SIZE];
+		if (dirent->d_namlen != namelen ||
+		    memcmp(dirent->d_name, name, namelen) != 0)
+			continue;
+		if (!vsfnode_dir_cached(dir)) {
+			error = EJUSTRETURN;
+			break;
+		}
+		sfprov_stat_from_cstat(statp,
+		    SFFS_DIRENTS_STAT(cur_buf, slot->ds_rec));
+		*timep = dir->sf_dir_time;
+		error = 0;
+		break;
+	}
+out:
+	sx_sunlock(&dir->sf_dir_lock);
+	return (error);
+}
+
+/*
+ * Seed the attribute cache of child np from the listing entry 'cs' of a
+ * directory fetched at 'when', unless the cache is newer or np has writes
+ * the host has not seen, whose size the listing would undo.  np is
+ * usually not locked by the caller, so this takes its interlock.
+ */
+static void
+vsfnode_seed_stat(struct vboxfs_node *np, const sffs_cstat_t *cs,
+    uint64_t when)
+{
+
+	VBOXFS_NODE_LOCK(np);
+	if (np->sf_stat_time < when && np->sf_wsize == 0 &&
+	    IFTOVT(cs->sf_mode) == np->sf_type) {
+		sfprov_stat_from_cstat(&np->sf_stat, cs);
+		np->sf_stat_time = when;
+	}
+	VBOXFS_NODE_UNLOCK(np);
+}
+
+/*
+ * Finish freshly fetched listing buffers: fill in each entry's inode
+ * number, so readdir can copy the records out as they are, and seed the
+ * attribute cache of every live child from the attributes the listing
+ * already carries.
+ */
+static void
+vsfnode_dir_prime(struct vboxfs_node *dir, sffs_dirents_t *bufs)
+{
+	sffs_dirents_t *cur_buf;
+	struct dirent *dirent;
+	struct vboxfs_node *np;
+	int i;
+
+	sx_assert(&dir->sf_dir_lock, SA_XLOCKED);
+	for (cur_buf = bufs; cur_buf != NULL;
+	    cur_buf = cur_buf->sf_next) {
+		dirent = (struct dirent *)&cur_buf->sf_entries[0];
+		for (i = 0; i < cur_buf->sf_nents; i++,
+		    dirent = (struct dirent *)
+		    ((char *)dirent + dirent->d_reclen)) {
+			if (strcmp(dirent->d_name, ".") == 0) {
+				dirent->d_fileno = dir->sf_ino;
+				continue;
+			}
+			if (strcmp(dirent->d_name, "..") == 0) {
+				np = dir->sf_parent;
+				if (np == NULL)
+					np = dir;
+				dirent->d_fileno = np->sf_ino;
+				continue;
+			}
+			np = vboxfs_node_lookup(dir->vboxfsmp, dir,
+			    dirent->d_name, dirent->d_namlen);
+			if (np == NULL) {
+				dirent->d_fileno = vboxfs_path_ino(dir,
+				    dirent->d_name, dirent->d_namlen);
+				continue;
+			}
+			dirent->d_fileno = np->sf_ino;
+			vsfnode_seed_stat(np, SFFS_DIRENTS_STAT(cur_buf, i),
+			    dir->sf_dir_time);
+			vboxfs_node_rele(dir->vboxfsmp, np);
+		}
+	}
+}
+
+/*
+ * Append listing buffers to the directory's listing.  Once the listing
+ * holds more than vboxfs_dir_maxbufs buffers, those the reader at 'pos'
+ * has moved past are freed, so a reader streaming through a huge
+ * directory needs bounded memory.
+ */
+static void
+vsfnode_dir_append(struct vboxfs_node *dir, sffs_dirents_t *bufs, off_t pos)
+{
+	sffs_dirents_t *head, **vec;
+	u_int size;
+
+	sx_assert(&dir->sf_dir_lock, SA_XLOCKED);
+
+	vsfnode_dir_prime(dir, bufs);
+	if (!dir->sf_dir_listed) {
+		sx_xlock(&vboxfs_dir_lock);
+		LIST_INSERT_HEAD(&vboxfs_dir_nodes, dir, sf_dir_link);
+		dir->sf_dir_listed = 1;
+		sx_xunlock(&vboxfs_dir_lock);
+	}
+	if (dir->sf_dir_tail != NULL)
+		dir->sf_dir_tail->sf_next = bufs;
+	else
+		dir->sf_dir_list = bufs;
+	for (; bufs != NULL; bufs = bufs->sf_next) {
+		if (dir->sf_dir_nvec == dir->sf_dir_vecsize) {
+			size = MAX(16, dir->sf_dir_vecsize * 2);
+			vec = malloc(size * sizeof(*vec), M_VBOXVFS,
+			    M_WAITOK | M_ZERO);
+			if (dir->sf_dir_vec != NULL) {
+				memcpy(vec, dir->sf_dir_vec,
+				    dir->sf_dir_nvec * sizeof(*vec));
+				free(dir->sf_dir_vec, M_VBOXVFS);
+			}
+			dir->sf_dir_vec = vec;
+			dir->sf_dir_vecsize = size;
+		}
+		dir->sf_dir_vec[dir->sf_dir_nvec++] = bufs;
+		dir->sf_dir_tail = bufs;
+	}
+
+	while (vboxfs_dir_maxbufs != 0 &&
+	    dir->sf_dir_nvec - dir->sf_dir_first > vboxfs_dir_maxbufs &&
+	    (head = dir->sf_dir_list) != dir->sf_dir_tail &&
+	    dir->sf_dir_first < pos / SFFS_DIRENTS_SIZE) {
+		dir->sf_dir_list = head->sf_next;
+		dir->sf_dir_vec[dir->sf_dir_first++] = NULL;
+		free(head, M_VBOXVFS);
+	}
+}
+
+/*
+ * Fetch the next host batch of the directory listing and append it.
+ */
+static int
+vsfnode_dir_fetch(struct vboxfs_node *dir, off_t pos)
+{
+	sffs_dirents_t *bufs;
+	int error;
+
+	sx_assert(&dir->sf_dir_lock, SA_XLOCKED);
+	MPASS(dir->sf_dir_stream != NULL);
+
+	error = sfprov_readdir_next(dir->sf_dir_stream, &bufs);
+	if (error != 0)
+		return (error);
+	if (bufs == NULL) {
+		sfprov_readdir_close(dir->sf_dir_stream);
+		dir->sf_dir_stream = NULL;
+		vsfnode_dir_index(dir);
+		return (0);
+	}
+	vsfnode_dir_append(dir, bufs, pos);
+	return (0);
+}
+
+/*
+ * Find the listing buffer holding directory offset 'off', fetching from
+ * the host until it is covered or the listing ends.  Returns the buffer,
+ * or NULL past the end, its index and the offset within it.
+ */
+static int
+vsfnode_dir_seek(struct vboxfs_node *dir, off_t off, sffs_dirents_t **bufp,
+    u_int *idxp, off_t *offp)
+{
+	u_int idx;
+	int error;
+
+	sx_assert(&dir->sf_dir_lock, SA_XLOCKED);
+	MPASS(off / SFFS_DIRENTS_SIZE >= dir->sf_dir_first);
+
+	idx = off / SFFS_DIRENTS_SIZE;
+	while (idx >= dir->sf_dir_nvec && dir->sf_dir_stream != NULL) {
+		error = vsfnode_dir_fetch(dir, off);
+		if (error != 0)
+			return (error);
+	}
+	*bufp = (idx < dir->sf_dir_nvec) ? dir->sf_dir_vec[idx] : NULL;
+	*idxp = idx;
+	*offp = off % SFFS_DIRENTS_SIZE;
+	return (0);
+}
+
+/*
+ * Start a new listing of the directory, reading it with the open host
+ * handle 'fp' if there is one.
+ */
+static int
+vsfnode_dir_start(struct vboxfs_node *dir, sfp_file_t *fp, off_t pos)
+{
+	sffs_dirents_t *bufs;
+	int error;
+
+	sx_assert(&dir->sf_dir_lock, SA_XLOCKED);
+	MPASS(dir->sf_dir_time == 0);
+
+	/*
+	 * Remember the directory's times, to revalidate the listing
+	 * against later.  Should it change while being listed, the next
+	 * check sees newer times and refetches.
+	 */
+	if (!vsfnode_stat_cached(dir) && vsfnode_update_stat_cache(dir) != 0)
+		bzero(&dir->sf_stat, sizeof(dir->sf_stat));
+	dir->sf_dir_mtime = dir->sf_stat.sf_mtime;
+	dir->sf_dir_ctime = dir->sf_stat.sf_ctime;
+	dir->sf_dir_time = vsfnode_cur_time_usec();
+	dir->sf_dir_checked = dir->sf_dir_time;
+	if (dir->vboxfsmp->sf_index != NULL) {
+		error = vboxfs_index_readdir(dir->vboxfsmp->sf_index,
+		    dir->sf_ient, &bufs);
+		if (error == 0)
+			vsfnode_dir_append(dir, bufs, pos);
+	} else
+		error = sfprov_readdir_open(dir->vboxfsmp->sf_handle,
+		    dir->sf_spath, fp, &dir->sf_dir_stream);
+	if (error != 0)
+		dir->sf_dir_time = 0;
+	return (error);
 }
 
 static int
@@ -430,11 +1031,39 @@ vboxfs_open(struct vop_open_args *ap)
 	MPASS(VOP_ISLOCKED(vp));
 
 	np = VP_TO_VBOXFS_NODE(ap->a_vp);
-	error = sfprov_open(np->vboxfsmp->sf_handle, np->sf_path, &fp);
-	if (error != 0)
-		goto out;
 
-	np->sf_file = fp;
+	/*
+	 * All opens of a node share one host handle, which stays open
+	 * until the last close.  A directory's handle also serves readdir,
+	 * except on an immutable mount, where readdir needs none.
+	 */
+	if (np->sf_file == NULL &&
+	    (np->sf_type != VDIR || np->vboxfsmp->sf_index == NULL)) {
+		if (np->sf_type == VDIR)
+			error = sfprov_opendir(np->vboxfsmp->sf_handle,
+			    np->sf_spath, &fp);
+		else
+			error = sfprov_open(np->vboxfsmp->sf_handle,
+			    np->sf_spath, &fp);
+		if (error != 0)
+			goto out;
+		np->sf_file = fp;
+	}
+	error = 0;
+
+	/*
+	 * Close-to-open: whoever opens the file sees the attributes the
+	 * host has now, and a directory's listing is rechecked against the
+	 * host before it is read again.
+	 */
+	if (np->vboxfsmp->sf_consistency == VBOXFS_CONS_CTO) {
+		(void) vsfnode_update_stat_cache(np);
+		if (np->sf_type == VDIR) {
+			sx_xlock(&np->sf_dir_lock);
+			np->sf_dir_checked = 0;
+			sx_xunlock(&np->sf_dir_lock);
+		}
+	}
 	vnode_create_vobject(ap->a_vp, 0, ap->a_td);
 
 out:
@@ -449,34 +1078,174 @@ vfsnode_invalidate_stat_cache(struct vboxfs_node *np)
 	np->sf_stat_time = 0;
 }
 
+/*
+ * Note a change we made to the host file: its new mtime and size are
+ * ours, see vsfnode_cache_check(), and the next fsync has to reach the
+ * host, see vsfnode_host_sync().  Called from the vboxfs_rio_tq threads
+ * too, hence the lock.
+ */
+static void
+vsfnode_host_wrote(struct vboxfs_node *np)
+{
+
+	VBOXFS_NODE_LOCK(np);
+	np->sf_cache_own = 1;
+	np->sf_wgen++;
+	VBOXFS_NODE_UNLOCK(np);
+	vfsnode_invalidate_stat_cache(np);
+}
+
+/*
+ * Have the host flush the file to its disk, unless the last successful
+ * flush already covered every write we made to it.  fsync(2) holds the
+ * vnode lock exclusively, so flushes of one file never overlap; writes
+ * from the vboxfs_rio_tq threads may still land during one and are left
+ * for the next.
+ */
+static int
+vsfnode_host_sync(struct vboxfs_node *np)
+{
+	uint64_t gen;
+	int error;
+
+	VBOXFS_NODE_LOCK(np);
+	gen = np->sf_wgen;
+	VBOXFS_NODE_UNLOCK(np);
+	if (np->sf_sgen >= gen)
+		return (0);
+
+	error = sfprov_fsync(np->sf_file);
+	if (error == 0)
+		np->sf_sgen = gen;
+	return (error);
+}
+
+/*
+ * Send the node's dirty buffers to the host, waiting for them if waitfor
+ * is MNT_WAIT.
+ */
+static int
+vsfnode_flush(struct vnode *vp, int waitfor, struct thread *td)
+{
+	struct vop_fsync_args a;
+
+	a.a_gen.a_desc = &vop_fsync_desc;
+	a.a_vp = vp;
+	a.a_waitfor = waitfor;
+	a.a_td = td;
+	return (vop_stdfsync(&a));
+}
+
+/*
+ * Set the size of the host file.  Dirty buffers past the new end are
+ * dropped and the rest are written first, cut at the new end by
+ * vsfnode_strategy_write(); the cache is dropped after.
+ */
+static int
+vsfnode_truncate(struct vnode *vp, off_t length)
+{
+	struct vboxfs_node *np = VP_TO_VBOXFS_NODE(vp);
+	int error;
+
+	error = vtruncbuf(vp, NOCRED, length, np->vboxfsmp->sf_bsize);
+	if (error != 0)
+		return (error);
+	vnode_pager_setsize(vp, length);
+	error = vsfnode_flush(vp, MNT_WAIT, curthread);
+	if (error != 0)
+		return (error);
+	error = sfprov_set_size(np->vboxfsmp->sf_handle, np->sf_spath, length);
+	if (error != 0)
+		return (error);
+	vsfnode_host_wrote(np);
+	np->sf_wsize = 0;
+	return (vinvalbuf(vp, V_SAVE, 0, 0));
+}
+
+/*
+ * Close the node's host handle.  A listing nobody read to the end reads
+ * through it and is dropped first; read-ahead and write-back in flight
+ * use it too and are waited for.
+ */
+static void
+vsfnode_close_file(struct vboxfs_node *np)
+{
+
+	if (np->sf_type == VDIR) {
+		sx_xlock(&np->sf_dir_lock);
+		if (np->sf_dir_stream != NULL)
+			vfsnode_clear_dir_list_locked(np);
+		sx_xunlock(&np->sf_dir_lock);
+	}
+	if (np->sf_file == NULL)
+		return;
+	VBOXFS_NODE_LOCK(np);
+	while (np->sf_rio > 0)
+		msleep(&np->sf_rio, VBOXFS_NODE_MTX(np), PVFS, "vsfrio", 0);
+	VBOXFS_NODE_UNLOCK(np);
+	(void) sfprov_close(np->sf_file);
+	np->sf_file = NULL;
+}
+
+/*
+ * Give the node the handle and attributes the host returned when it
+ * created the file, so that the open which follows needs no host call.
+ * A node that already had a handle for the name keeps it.
+ */
+static void
+vsfnode_attach_file(struct vboxfs_node *np, sfp_file_t *fp,
+    const sffs_stat_t *stat)
+{
+
+	if (np->sf_file == NULL)
+		np->sf_file = fp;
+	else
+		(void) sfprov_close(fp);
+	np->sf_stat = *stat;
+	np->sf_stat_time = vsfnode_cur_time_usec();
+}
+
 static int
 vboxfs_close(struct vop_close_args *ap)
 {
 
 	struct vnode *vp = ap->a_vp;
 	struct vboxfs_node *np;
+	int error = 0;
 
 	np = VP_TO_VBOXFS_NODE(vp);
 
 	/*
-	 * Free the directory entries for the node. We do this on this call
-	 * here because the directory node may not become inactive for a long
-	 * time after the readdir is over. Case in point, if somebody cd's into
-	 * the directory then it won't become inactive until they cd away again.
-	 * In such a case we would end up with the directory listing not getting
-	 * updated (i.e. the result of 'ls' always being the same) until they
-	 * change the working directory.
+	 * With write-back a writer's close sends its changes to the host,
+	 * and so does the last close, which takes the handle away.  What
+	 * cannot be written then is lost, and the error says so.
 	 */
-	vfsnode_clear_dir_list(np);
+	if (vp->v_type == VREG && np->vboxfsmp->sf_writeback &&
+	    ((ap->a_fflag & FWRITE) != 0 || vp->v_usecount <= 1)) {
+		error = vsfnode_flush(vp, MNT_WAIT, ap->a_td);
+		if (error != 0 && vp->v_usecount <= 1)
+			(void) vinvalbuf(vp, 0, 0, 0);
+		if (error == 0 && vp->v_bufobj.bo_dirty.bv_cnt == 0)
+			np->sf_wsize = 0;
+	}
 
-	vfsnode_invalidate_stat_cache(np);
+	/*
+	 * The directory listing is kept past close so that lookups which
+	 * follow a readdir (ls -l, find) can take their attributes from it.
+	 * readdir at offset 0 still revalidates it, so 'ls' sees host
+	 * changes while somebody has cd'ed into the directory.
+	 *
+	 * Only strict consistency drops the attributes on close; cto
+	 * refetches them on open instead and relaxed leaves them to the
+	 * attribute cache ttl.
+	 */
+	if (np->vboxfsmp->sf_consistency == VBOXFS_CONS_STRICT)
+		vfsnode_invalidate_stat_cache(np);
 
-	if (np->sf_file != NULL && vp->v_usecount <= 1) {
-		(void) sfprov_close(np->sf_file);
-		np->sf_file = NULL;
-	}
+	if (vp->v_usecount <= 1)
+		vsfnode_close_file(np);
 
-	return (0);
+	return (error);
 }
 
 static int
@@ -586,7 +1355,7 @@ vboxfs_setattr(struct vop_setattr_args *ap)
 
 	vfsnode_invalidate_stat_cache(np);
 
-	error = sfprov_set_attr(np->vboxfsmp->sf_handle, np->sf_path,
+	error = sfprov_set_attr(np->vboxfsmp->sf_handle, np->sf_spath,
 	    mode, vap->va_atime, vap->va_mtime, vap->va_ctime);
 #if 0
 	if (error == ENOENT)
@@ -599,7 +1368,7 @@ vboxfs_setattr(struct vop_setattr_args *ap)
 		case VLNK:
 			/* FALLTHROUGH */
 		case VREG:
-			error = sfprov_set_size(np->vboxfsmp->sf_handle, np->sf_path, vap->va_size);
+			error = vsfnode_truncate(vp, vap->va_size);
 			break;
 		case VCHR:
 			/* FALLTHROUGH */
@@ -621,10 +1390,463 @@ vboxfs_setattr(struct vop_setattr_args *ap)
 	return (error);
 }
 
-#define blkoff(vboxfsmp, loc)	((loc) & (vboxfsmp)->bmask)
+#define blkoff(vboxfsmp, loc)	((loc) & ((vboxfsmp)->sf_bsize - 1))
+
+/*
+ * Cached file data is tagged with the host mtime and size it was read
+ * at.  Once refreshed attributes disagree with the tag the host file has
+ * changed, and the cache is dropped as NFS does, unless the only changes
+ * since are our own writes (sf_cache_own), which invalidated what they
+ * overwrote themselves.
+ */
+static int
+vsfnode_cache_valid(struct vboxfs_node *np)
+{
+
+	return (timespeccmp(&np->sf_stat.sf_mtime, &np->sf_cache_mtime, ==) &&
+	    np->sf_stat.sf_size == np->sf_cache_size);
+}
+
+static int
+vsfnode_cache_check(struct vnode *vp)
+{
+	struct vboxfs_node *np = VP_TO_VBOXFS_NODE(vp);
+	int error, lktype;
+
+	if (!vsfnode_stat_cached(np)) {
+		error = vsfnode_update_stat_cache(np);
+		if (error != 0)
+			return (error);
+	}
+	if (vsfnode_cache_valid(np))
+		return (0);
+
+	error = 0;
+	lktype = VOP_ISLOCKED(vp);
+	if (lktype != LK_EXCLUSIVE) {
+		vn_lock(vp, LK_UPGRADE | LK_RETRY);
+		if ((vp->v_iflag & VI_DOOMED) != 0) {
+			error = EBADF;
+			goto out;
+		}
+	}
+	if (!vsfnode_cache_valid(np)) {
+		if (!np->sf_cache_own)
+			error = vinvalbuf(vp, V_SAVE, 0, 0);
+		if (error == 0) {
+			vnode_pager_setsize(vp, np->sf_stat.sf_size);
+			np->sf_cache_mtime = np->sf_stat.sf_mtime;
+			np->sf_cache_size = np->sf_stat.sf_size;
+			np->sf_cache_own = 0;
+		}
+	}
+out:
+	if (lktype == LK_SHARED)
+		vn_lock(vp, LK_DOWNGRADE | LK_RETRY);
+	return (error);
+}
+
+/*
+ * Drop the cached data of [start, end): the buffers first, which unwires
+ * their pages, then the pages left in the VM object.
+ */
+static void
+vsfnode_cache_inval(struct vnode *vp, off_t start, off_t end)
+{
+	struct vboxfs_mnt *vboxfsmp = VP_TO_VBOXFS_NODE(vp)->vboxfsmp;
+	struct bufobj *bo = &vp->v_bufobj;
+	struct buf *bp;
+	vm_object_t obj;
+	daddr_t lbn;
+
+	ASSERT_VOP_ELOCKED(vp, "vsfnode_cache_inval");
+	if (start >= end)
+		return;
+
+	for (lbn = start / vboxfsmp->sf_bsize;
+	    (off_t)lbn * vboxfsmp->sf_bsize < end; lbn++) {
+		BO_RLOCK(bo);
+		bp = gbincore(bo, lbn);
+		BO_RUNLOCK(bo);
+		if (bp == NULL)
+			continue;
+		bp = getblk(vp, lbn, vboxfsmp->sf_bsize, 0, 0, 0);
+		bp->b_flags |= B_INVAL | B_NOCACHE;
+		brelse(bp);
+	}
+
+	if ((obj = vp->v_object) != NULL) {
+		VM_OBJECT_WLOCK(obj);
+		vm_object_page_remove(obj, OFF_TO_IDX(start),
+		    OFF_TO_IDX(round_page(end)), OBJPR_CLEANONLY);
+		VM_OBJECT_WUNLOCK(obj);
+	}
+}
+
+/*
+ * Sequential read detection.  A read that starts where the last one on
+ * the node ended extends the run, anything else ends it.  The read-ahead
+ * window is the number of blocks that must be in flight to cover one
+ * host read (sf_rtt) at the pace the reader consumes blocks while not
+ * waiting for us (sf_ra_pace), so a slow consumer of a fast host reads
+ * ahead little and a fast one of a slow host a lot.  As in FFS the run's
+ * length bounds the window, which makes it ramp up.
+ */
+static int
+vsfnode_ra_window(struct vboxfs_node *np, struct uio *uio, int ioseq)
+{
+	struct vboxfs_mnt *vboxfsmp = np->vboxfsmp;
+	uint64_t now;
+	u_int pace;
+	int seq;
+
+	now = vsfnode_precise_time_usec();
+	VBOXFS_NODE_LOCK(np);
+	if (uio->uio_offset == np->sf_ra_next) {
+		if (np->sf_ra_idle != 0 && np->sf_ra_len > 0)
+			np->sf_ra_pace = vboxfs_ra_avg(np->sf_ra_pace,
+			    now - np->sf_ra_idle, vboxfsmp->sf_bsize,
+			    np->sf_ra_len);
+		np->sf_ra_seq = MIN(np->sf_ra_seq +
+		    howmany(uio->uio_resid, vboxfsmp->sf_bsize), IO_SEQMAX);
+	} else {
+		np->sf_ra_seq = 0;
+		np->sf_ra_pace = 0;
+	}
+	seq = MAX(np->sf_ra_seq, ioseq);
+	pace = np->sf_ra_pace;
+	VBOXFS_NODE_UNLOCK(np);
+
+	return (vboxfs_ra_window(vboxfsmp->sf_rtt, pace, seq,
+	    vboxfs_readahead));
+}
+
+static void
+vsfnode_ra_done(struct vboxfs_node *np, struct uio *uio, ssize_t len)
+{
+
+	VBOXFS_NODE_LOCK(np);
+	np->sf_ra_next = uio->uio_offset;
+	np->sf_ra_len = len;
+	np->sf_ra_idle = vsfnode_precise_time_usec();
+	VBOXFS_NODE_UNLOCK(np);
+}
+
+/*
+ * Read directly into the pages backing the uio, one iovec segment at a
+ * time.  User pages are faulted in and held for the duration of the host
+ * call; kernel buffers are already resident and only need translating.
+ */
+static int
+vboxfs_read_pages(struct vboxfs_node *np, struct uio *uio)
+{
+	struct iovec		*iov;
+	vm_page_t		*ma;
+	RTGCPHYS64		*pa;
+	vm_offset_t		va;
+	size_t			len;
+	uint32_t		done;
+	int			error = 0;
+	int			i, npages, held;
+	u_int			maxpages;
+
+	maxpages = MIN(atop(np->vboxfsmp->sf_iosize),
+	    atop(round_page(uio->uio_resid)) + 1);
+	ma = malloc(maxpages * sizeof(*ma), M_VBOXVFS, M_WAITOK);
+	pa = malloc(maxpages * sizeof(*pa), M_VBOXVFS, M_WAITOK);
+
+	while (uio->uio_resid > 0) {
+		iov = uio->uio_iov;
+		if (iov->iov_len == 0) {
+			uio->uio_iov++;
+			uio->uio_iovcnt--;
+			continue;
+		}
+
+		va = (vm_offset_t)iov->iov_base;
+		len = MIN(iov->iov_len, ptoa(maxpages) - (va & PAGE_MASK));
+		npages = atop(round_page((va & PAGE_MASK) + len));
+		held = 0;
+
+		if (uio->uio_segflg == UIO_USERSPACE) {
+			held = vm_fault_quick_hold_pages(
+			    &uio->uio_td->td_proc->p_vmspace->vm_map, va, len,
+			    VM_PROT_WRITE, ma, maxpages);
+			if (held < 0) {
+				error = EFAULT;
+				break;
+			}
+			for (i = 0; i < held; i++)
+				pa[i] = VM_PAGE_TO_PHYS(ma[i]);
+		} else {
+			for (i = 0; i < npages; i++)
+				pa[i] = pmap_kextract(trunc_page(va) + ptoa(i));
+		}
+
+		done = len;
+		error = sfprov_read_pages(np->sf_file, uio->uio_offset, &done,
+		    va & PAGE_MASK, npages, pa);
+		if (held > 0)
+			vm_page_unhold_pages(ma, held);
+		if (error != 0)
+			break;
+
+		iov->iov_base = (char *)iov->iov_base + done;
+		iov->iov_len -= done;
+		uio->uio_resid -= done;
+		uio->uio_offset += done;
+
+		/* short read means end of file */
+		if (done < len)
+			break;
+	}
+
+	free(pa, M_VBOXVFS);
+	free(ma, M_VBOXVFS);
+	return (error);
+}
+
+/*
+ * Fallback for hosts that cannot take page lists: read through a wired
+ * transfer buffer and copy out.
+ */
+static int
+vboxfs_read_bounce(struct vboxfs_node *np, struct uio *uio)
+{
+	int			error = 0;
+	uint32_t		done;
+	unsigned long		offset;
+	size_t			bufsize;
+	struct vboxfs_iobuf	*ib;
+
+	bufsize = MIN(np->vboxfsmp->sf_iosize, round_page(uio->uio_resid));
+	ib = vboxfs_iobuf_get(np->vboxfsmp, bufsize);
+
+	do {
+		offset = uio->uio_offset;
+		done = MIN(bufsize, uio->uio_resid);
+		error = sfprov_read(np->sf_file, ib->ib_data,
+		    offset, &done, 1);
+		if (error == 0 && done > 0)
+			error = uiomove(ib->ib_data, done, uio);
+	} while (error == 0 && uio->uio_resid > 0 && done > 0);
+
+	vboxfs_iobuf_put(np->vboxfsmp, ib);
+
+	return (error);
+}
+
+/*
+ * Read through the buffer cache, one sf_bsize block at a time, in the
+ * manner of msdosfs.  Blocks are filled by vboxfs_strategy(); sequential
+ * readers get the following ones read ahead asynchronously, clustered
+ * into host transfers of up to mnt_iosize_max bytes.
+ */
+static int
+vboxfs_read_cached(struct vnode *vp, struct uio *uio, int ioflag)
+{
+	struct vboxfs_node	*np = VP_TO_VBOXFS_NODE(vp);
+	struct vboxfs_mnt	*vboxfsmp = np->vboxfsmp;
+	struct buf		*bp;
+	daddr_t			lbn, nextlbn;
+	off_t			filesize;
+	ssize_t			resid;
+	long			on, n;
+	int			bsize, error, rasize, seqcount;
+
+	error = vsfnode_cache_check(vp);
+	if (error != 0)
+		return (error);
+
+	bsize = vboxfsmp->sf_bsize;
+	filesize = np->sf_stat.sf_size;
+	resid = uio->uio_resid;
+	seqcount = vsfnode_ra_window(np, uio, ioflag >> IO_SEQSHIFT);
+
+	do {
+		if (uio->uio_offset >= filesize)
+			break;
+		lbn = uio->uio_offset / bsize;
+		on = blkoff(vboxfsmp, uio->uio_offset);
+		n = MIN(bsize - on, uio->uio_resid);
+		n = MIN(n, filesize - uio->uio_offset);
+		nextlbn = lbn + 1;
+
+		if ((off_t)nextlbn * bsize >= filesize) {
+			error = bread(vp, lbn, bsize, NOCRED, &bp);
+		} else if ((vp->v_mount->mnt_flag & MNT_NOCLUSTERR) == 0) {
+			error = cluster_read(vp, filesize, lbn, bsize, NOCRED,
+			    on + uio->uio_resid, seqcount, 0, &bp);
+		} else if (seqcount > 1) {
+			rasize = bsize;
+			error = breadn(vp, lbn, bsize, &nextlbn, &rasize, 1,
+			    NOCRED, &bp);
+		} else {
+			error = bread(vp, lbn, bsize, NOCRED, &bp);
+		}
+		if (error != 0) {
+			/* Newer kernels release the buffer themselves. */
+			if (bp != NULL)
+				brelse(bp);
+			break;
+		}
+		error = uiomove(bp->b_data + on, n, uio);
+		bqrelse(bp);
+	} while (error == 0 && uio->uio_resid > 0);
+
+	vsfnode_ra_done(np, uio, resid - uio->uio_resid);
+	return (error);
+}
 
 static int
 vboxfs_read(struct vop_read_args *ap)
+{
+	struct vnode		*vp = ap->a_vp;
+	struct uio 		*uio = ap->a_uio;
+	struct vboxfs_node	*np = VP_TO_VBOXFS_NODE(vp);
+	int			error = 0;
+	ssize_t			total;
+
+	if (vp->v_type == VDIR)
+		return (EISDIR);
+
+	if (vp->v_type != VREG)
+		return (EINVAL);
+
+	if (uio->uio_offset < 0)
+		return (EINVAL);
+
+	total = uio->uio_resid;
+	if (total == 0)
+		return (0);
+
+	/*
+	 * O_DIRECT reads go to the host, past the buffer cache, so they must
+	 * first push out what write-back left dirty there.
+	 */
+	if ((ap->a_ioflag & IO_DIRECT) == 0)
+		error = vboxfs_read_cached(vp, uio, ap->a_ioflag);
+	else if (np->vboxfsmp->sf_writeback &&
+	    (error = vsfnode_flush(vp, MNT_WAIT, uio->uio_td)) != 0)
+		return (error);
+	else if (sfprov_can_read_pages())
+		error = vboxfs_read_pages(np, uio);
+	else
+		error = vboxfs_read_bounce(np, uio);
+
+	/* a partial read is never an error */
+	if (total != uio->uio_resid)
+		error = 0;
+
+	return (error);
+}
+
+/*
+ * Write-back: copy into buffer cache blocks and leave them to the syncer,
+ * the buffer daemon, fsync or close to send to the host, as msdosfs does.
+ * Completed blocks are clustered with their neighbours, so a run of small
+ * sequential writes reaches the host as a few large transfers.
+ */
+static int
+vboxfs_write_cached(struct vnode *vp, struct uio *uio, int ioflag)
+{
+	struct vboxfs_node	*np = VP_TO_VBOXFS_NODE(vp);
+	struct vboxfs_mnt	*vboxfsmp = np->vboxfsmp;
+	struct buf		*bp;
+	daddr_t			lbn;
+	off_t			osize, filesize;
+	ssize_t			moved, resid;
+	long			on, n;
+	int			bsize, error, fresh, seqcount;
+
+	error = vsfnode_cache_check(vp);
+	if (error != 0)
+		return (error);
+	if ((ioflag & IO_APPEND) != 0)
+		uio->uio_offset = np->sf_stat.sf_size;
+
+	bsize = vboxfsmp->sf_bsize;
+	osize = filesize = np->sf_stat.sf_size;
+	resid = uio->uio_resid;
+	seqcount = ioflag >> IO_SEQSHIFT;
+
+	do {
+		lbn = uio->uio_offset / bsize;
+		on = blkoff(vboxfsmp, uio->uio_offset);
+		n = MIN(bsize - on, uio->uio_resid);
+		if (uio->uio_offset + n > filesize) {
+			filesize = uio->uio_offset + n;
+			vnode_pager_setsize(vp, filesize);
+		}
+
+		/* Blocks overwritten whole or new need not be read. */
+		fresh = 0;
+		if ((on == 0 && n == bsize) || (off_t)lbn * bsize >= osize) {
+			bp = getblk(vp, lbn, bsize, 0, 0, 0);
+			if (n != bsize)
+				vfs_bio_clrbuf(bp);
+			else if ((bp->b_flags & B_CACHE) == 0)
+				fresh = 1;
+		} else {
+			error = bread(vp, lbn, bsize, NOCRED, &bp);
+			if (error != 0) {
+				if (bp != NULL)
+					brelse(bp);
+				break;
+			}
+		}
+
+		moved = uio->uio_resid;
+		error = uiomove(bp->b_data + on, n, uio);
+		if (error != 0) {
+			/*
+			 * A block neither read nor cleared holds stale
+			 * memory past what was copied: drop it, and the part
+			 * of the write that went into it, as ffs does.
+			 */
+			if (fresh) {
+				moved -= uio->uio_resid;
+				uio->uio_resid += moved;
+				uio->uio_offset -= moved;
+				bp->b_flags |= B_INVAL | B_NOCACHE;
+				brelse(bp);
+			} else
+				bdwrite(bp);
+			break;
+		}
+		if ((ioflag & IO_SYNC) != 0)
+			error = bwrite(bp);
+		else if (vm_page_count_severe() || buf_dirty_count_severe())
+			bawrite(bp);
+		else if (on + n == bsize) {
+			if ((vp->v_mount->mnt_flag & MNT_NOCLUSTERW) == 0)
+				cluster_write(vp, bp, filesize, seqcount, 0);
+			else
+				bawrite(bp);
+		} else
+			bdwrite(bp);
+	} while (error == 0 && uio->uio_resid > 0);
+
+	/* A failed copy did not extend the file as far as planned. */
+	if (filesize > MAX(osize, uio->uio_offset)) {
+		filesize = MAX(osize, uio->uio_offset);
+		vnode_pager_setsize(vp, filesize);
+	}
+	if (filesize > osize) {
+		np->sf_wsize = filesize;
+		np->sf_stat.sf_size = filesize;
+	}
+	if (uio->uio_resid != resid)
+		np->sf_cache_own = 1;
+
+	/* a partial write is never an error */
+	if (uio->uio_resid != resid)
+		error = 0;
+	return (error);
+}
+
+static int
+vboxfs_write(struct vop_write_args *ap)
 {
 	struct vnode		*vp = ap->a_vp;
 	struct uio 		*uio = ap->a_uio;
@@ -633,8 +1855,11 @@ vboxfs_read(struct vop_read_args *ap)
 	uint32_t		bytes;
 	uint32_t		done;
 	unsigned long		offset;
-	ssize_t			total;
-	void			*tmpbuf;
+	off_t			start, end;
+	ssize_t			total, resid, skip;
+	size_t			bufsize;
+	struct vboxfs_iobuf	*ib;
+	vm_object_t		obj;
 
 	if (vp->v_type == VDIR)
 		return (EISDIR);
@@ -649,89 +1874,484 @@ vboxfs_read(struct vop_read_args *ap)
 	if (total == 0)
 		return (0);
 
-	/*
-	 * XXXGONZO: this is just to get things working
-	 * should be optimized
-	 */
-	tmpbuf = contigmalloc(PAGE_SIZE, M_DEVBUF, M_WAITOK, 0, ~0, PAGE_SIZE, 0);
-	if (tmpbuf == 0)
-		return (ENOMEM);
+	/*
+	 * With write-back, O_DIRECT writes go to the host as usual, after
+	 * the buffered ones they must not be overwritten by.
+	 */
+	if (np->vboxfsmp->sf_writeback) {
+		if ((ap->a_ioflag & IO_DIRECT) == 0)
+			return (vboxfs_write_cached(vp, uio, ap->a_ioflag));
+		error = vsfnode_flush(vp, MNT_WAIT, uio->uio_td);
+		if (error != 0)
+			return (error);
+	}
+	start = uio->uio_offset;
+
+	bufsize = MIN(np->vboxfsmp->sf_iosize, round_page(total));
+	ib = vboxfs_iobuf_get(np->vboxfsmp, bufsize);
+
+	end = start;
+	do {
+		offset = uio->uio_offset;
+		bytes = MIN(bufsize, uio->uio_resid);
+		resid = uio->uio_resid;
+		error = uiomove(ib->ib_data, bytes, uio);
+		if (error != 0) {
+			skip = resid - uio->uio_resid;
+			break;
+		}
+		done = bytes;
+		error = sfprov_write(np->sf_file, ib->ib_data,
+		    offset, &done, 1);
+		if (error != 0) {
+			skip = bytes;
+			break;
+		}
+		end += done;
+		skip = bytes - done;
+	} while (skip == 0 && uio->uio_resid > 0);
+
+	vboxfs_iobuf_put(np->vboxfsmp, ib);
+
+	/*
+	 * Give back what was copied in but did not reach the host, and stop
+	 * there: the caller only looks at the offset and the residual count.
+	 */
+	uio->uio_resid += skip;
+	uio->uio_offset -= skip;
+	MPASS(uio->uio_offset == end);
+
+	/*
+	 * Whatever the buffer cache held of the range is stale now, unless
+	 * the write came from the very pages being paged out.  The host
+	 * mtime and size changes are ours, see vsfnode_cache_check().
+	 */
+	if (end > start) {
+		if ((ap->a_ioflag & IO_VMIO) == 0)
+			vsfnode_cache_inval(vp, start, end);
+		if ((obj = vp->v_object) != NULL &&
+		    end > obj->un_pager.vnp.vnp_size)
+			vnode_pager_setsize(vp, end);
+		vsfnode_host_wrote(np);
+	}
+
+	/* a partial write is never an error */
+	if (end > start)
+		error = 0;
+
+	return (error);
+}
+
+/*
+ * Buffer cache blocks map one to one to sf_bsize sized pieces of the host
+ * file, so any run of them can be read in one host transfer.
+ */
+static int
+vboxfs_bmap(struct vop_bmap_args *ap)
+{
+	struct vnode *vp = ap->a_vp;
+	struct vboxfs_mnt *vboxfsmp = VP_TO_VBOXFS_NODE(vp)->vboxfsmp;
+	int maxrun;
+
+	maxrun = vp->v_mount->mnt_iosize_max / vboxfsmp->sf_bsize - 1;
+	if (ap->a_bop != NULL)
+		*ap->a_bop = &vp->v_bufobj;
+	if (ap->a_bnp != NULL)
+		*ap->a_bnp = ap->a_bn * btodb(vboxfsmp->sf_bsize);
+	if (ap->a_runp != NULL)
+		*ap->a_runp = maxrun;
+	if (ap->a_runb != NULL)
+		*ap->a_runb = MIN(ap->a_bn, maxrun);
+	return (0);
+}
+
+/*
+ * Fill buffer bp from the host, with a page list if the host takes one.
+ * A short read is the end of the file and the rest of the buffer reads
+ * as zeroes.  The time taken feeds the mount's host read time sf_rtt,
+ * kept without a lock as an occasional lost sample does not matter.
+ */
+static void
+vsfnode_strategy_read(struct vboxfs_node *np, struct buf *bp)
+{
+	struct vboxfs_mnt	*vboxfsmp = np->vboxfsmp;
+	struct vboxfs_iobuf	*ib;
+	RTGCPHYS64		*pa;
+	vm_offset_t		va;
+	uint64_t		start;
+	uint32_t		done;
+	int			error, i, npages;
+
+	KASSERT(bp->b_bcount <= MAXPHYS, ("vboxfs: buffer too large"));
+	start = vsfnode_precise_time_usec();
+	done = bp->b_bcount;
+	if (np->sf_file == NULL) {
+		error = EBADF;
+	} else if (sfprov_can_read_pages()) {
+		va = (vm_offset_t)bp->b_data;
+		npages = atop(round_page((va & PAGE_MASK) + bp->b_bcount));
+		pa = malloc(npages * sizeof(*pa), M_VBOXVFS, M_WAITOK);
+		for (i = 0; i < npages; i++)
+			pa[i] = pmap_kextract(trunc_page(va) + ptoa(i));
+		error = sfprov_read_pages(np->sf_file, bp->b_iooffset, &done,
+		    va & PAGE_MASK, npages, pa);
+		free(pa, M_VBOXVFS);
+	} else {
+		ib = vboxfs_iobuf_get(vboxfsmp, bp->b_bcount);
+		error = sfprov_read(np->sf_file, ib->ib_data, bp->b_iooffset,
+		    &done, 1);
+		if (error == 0)
+			bcopy(ib->ib_data, bp->b_data, done);
+		vboxfs_iobuf_put(vboxfsmp, ib);
+	}
+
+	if (error != 0) {
+		bp->b_error = error;
+		bp->b_ioflags |= BIO_ERROR;
+		return;
+	}
+	if (done < bp->b_bcount)
+		bzero(bp->b_data + done, bp->b_bcount - done);
+	bp->b_resid = 0;
+
+	vboxfsmp->sf_rtt = vboxfs_ra_avg(vboxfsmp->sf_rtt,
+	    vsfnode_precise_time_usec() - start, vboxfsmp->sf_bsize,
+	    bp->b_bcount);
+}
 
-	do {
-		offset = uio->uio_offset;
-		done = bytes = min(PAGE_SIZE, uio->uio_resid);
-		error = sfprov_read(np->sf_file, tmpbuf,
-		    offset, &done, 0);
-		if (error == 0 && done > 0)
-			error = uiomove(tmpbuf, done, uio);
-	} while (error == 0 && uio->uio_resid > 0 && done > 0);
+/*
+ * Write buffer bp to the host, cut at the end of the file: the last
+ * block of a file is a whole buffer.  Like vboxfs_write() this changes
+ * the host mtime and size on our own account.
+ */
+static void
+vsfnode_strategy_write(struct vboxfs_node *np, struct buf *bp)
+{
+	struct vboxfs_mnt	*vboxfsmp = np->vboxfsmp;
+	struct vboxfs_iobuf	*ib;
+	RTGCPHYS64		*pa;
+	vm_object_t		obj;
+	vm_offset_t		va;
+	off_t			len;
+	uint32_t		done;
+	int			error, i, npages;
 
-	contigfree(tmpbuf, PAGE_SIZE, M_DEVBUF);
+	KASSERT(bp->b_bcount <= MAXPHYS, ("vboxfs: buffer too large"));
+	len = bp->b_bcount;
+	obj = bp->b_vp->v_object;
+	if (obj != NULL && bp->b_iooffset + len > obj->un_pager.vnp.vnp_size)
+		len = MAX(obj->un_pager.vnp.vnp_size - bp->b_iooffset, 0);
 
-	/* a partial read is never an error */
-	if (total != uio->uio_resid)
+	done = len;
+	if (len == 0) {
 		error = 0;
+	} else if (np->sf_file == NULL) {
+		error = EBADF;
+	} else if (sfprov_can_read_pages()) {
+		va = (vm_offset_t)bp->b_data;
+		npages = atop(round_page((va & PAGE_MASK) + len));
+		pa = malloc(npages * sizeof(*pa), M_VBOXVFS, M_WAITOK);
+		for (i = 0; i < npages; i++)
+			pa[i] = pmap_kextract(trunc_page(va) + ptoa(i));
+		error = sfprov_write_pages(np->sf_file, bp->b_iooffset, &done,
+		    va & PAGE_MASK, npages, pa);
+		free(pa, M_VBOXVFS);
+	} else {
+		ib = vboxfs_iobuf_get(vboxfsmp, len);
+		bcopy(bp->b_data, ib->ib_data, len);
+		error = sfprov_write(np->sf_file, ib->ib_data, bp->b_iooffset,
+		    &done, 1);
+		vboxfs_iobuf_put(vboxfsmp, ib);
+	}
+	if (error == 0 && done < len)
+		error = EIO;
 
-	return (error);
+	if (error != 0) {
+		bp->b_error = error;
+		bp->b_ioflags |= BIO_ERROR;
+		return;
+	}
+	bp->b_resid = 0;
+	if (len > 0)
+		vsfnode_host_wrote(np);
 }
 
-static int
-vboxfs_write(struct vop_write_args *ap)
+static void
+vsfnode_strategy_io(struct vboxfs_node *np, struct buf *bp)
 {
-	struct vnode		*vp = ap->a_vp;
-	struct uio 		*uio = ap->a_uio;
-	struct vboxfs_node	*np = VP_TO_VBOXFS_NODE(vp);
-	int			error = 0;
-	uint32_t		bytes;
-	uint32_t		done;
-	unsigned long		offset;
-	ssize_t			total;
-	void			*tmpbuf;
 
-	if (vp->v_type == VDIR)
-		return (EISDIR);
+	if (bp->b_iocmd == BIO_READ)
+		vsfnode_strategy_read(np, bp);
+	else
+		vsfnode_strategy_write(np, bp);
+}
 
-	if (vp->v_type != VREG)
-		return (EINVAL);
+struct vboxfs_rio {
+	struct task		ri_task;
+	struct vboxfs_node	*ri_np;
+	struct buf		*ri_bp;
+};
 
-	if (uio->uio_offset < 0)
-		return (EINVAL);
+static void
+vboxfs_rio_task(void *arg, int pending __unused)
+{
+	struct vboxfs_rio *rio = arg;
+	struct vboxfs_node *np = rio->ri_np;
+	struct buf *bp = rio->ri_bp;
+
+	free(rio, M_VBOXVFS);
+	vsfnode_strategy_io(np, bp);
+
+	/* vboxfs_close() may be waiting to close the handle. */
+	VBOXFS_NODE_LOCK(np);
+	if (--np->sf_rio == 0)
+		wakeup(&np->sf_rio);
+	VBOXFS_NODE_UNLOCK(np);
+	bufdone(bp);
+}
 
-	total = uio->uio_resid;
-	if (total == 0)
+/*
+ * Buffer cache I/O.  Writes come here only on write-back mounts; on the
+ * others vboxfs_write() goes to the host and leaves no dirty buffers.
+ * Asynchronous I/O, read-ahead and write-back, is handed to the
+ * vboxfs_rio_tq threads so that it overlaps with the caller; the node
+ * counts it in sf_rio.
+ */
+static int
+vboxfs_strategy(struct vop_strategy_args *ap)
+{
+	struct vnode *vp = ap->a_vp;
+	struct buf *bp = ap->a_bp;
+	struct vboxfs_node *np = VP_TO_VBOXFS_NODE(vp);
+	struct vboxfs_rio *rio;
+
+	/* Buffers come with b_blkno == b_lblkno until mapped, see ufs. */
+	if (bp->b_blkno == bp->b_lblkno) {
+		bp->b_blkno = bp->b_lblkno * btodb(np->vboxfsmp->sf_bsize);
+		bp->b_iooffset = dbtob(bp->b_blkno);
+	}
+
+	if (bp->b_iocmd != BIO_READ && bp->b_iocmd != BIO_WRITE) {
+		bp->b_error = EOPNOTSUPP;
+		bp->b_ioflags |= BIO_ERROR;
+		bufdone(bp);
 		return (0);
+	}
 
-	/*
-	 * XXXGONZO: this is just to get things working
-	 * should be optimized
-	 */
-	tmpbuf = contigmalloc(PAGE_SIZE, M_DEVBUF, M_WAITOK, 0, ~0, PAGE_SIZE, 0);
-	if (tmpbuf == 0)
-		return (ENOMEM);
+	if ((bp->b_flags & B_ASYNC) != 0 &&
+	    (rio = malloc(sizeof(*rio), M_VBOXVFS, M_NOWAIT)) != NULL) {
+		TASK_INIT(&rio->ri_task, 0, vboxfs_rio_task, rio);
+		rio->ri_np = np;
+		rio->ri_bp = bp;
+		VBOXFS_NODE_LOCK(np);
+		np->sf_rio++;
+		VBOXFS_NODE_UNLOCK(np);
+		taskqueue_enqueue(vboxfs_rio_tq, &rio->ri_task);
+		return (0);
+	}
 
-	do {
-		offset = uio->uio_offset;
-		bytes = min(PAGE_SIZE, uio->uio_resid);
-		error = uiomove(tmpbuf, bytes, uio);
+	vsfnode_strategy_io(np, bp);
+	bufdone(bp);
+	return (0);
+}
+
+/*
+ * Move the pages ma[0 .. npages - 1], which hold the file from offset off
+ * on, to or from the host, with page lists where the host takes them and
+ * through a transfer buffer elsewhere.  At most len bytes are moved, in
+ * transfers no larger than a buffer cache cluster; *donep is set to the
+ * number moved, which is short at the end of the file.
+ */
+static int
+vsfnode_page_io(struct vboxfs_node *np, vm_page_t *ma, int npages, off_t off,
+    size_t len, int write, size_t *donep)
+{
+	struct vboxfs_mnt	*vboxfsmp = np->vboxfsmp;
+	struct vboxfs_iobuf	*ib;
+	struct sf_buf		*sf;
+	RTGCPHYS64		*pa;
+	size_t			done, want;
+	uint32_t		cnt;
+	int			chunk, error, i, j, n;
+
+	if (np->sf_file == NULL)
+		return (EBADF);
+
+	chunk = MIN(atop(vboxfsmp->sf_iosize), btoc(MAXPHYS));
+	pa = NULL;
+	if (sfprov_can_read_pages())
+		pa = malloc(MIN(chunk, npages) * sizeof(*pa), M_VBOXVFS,
+		    M_WAITOK);
+	error = 0;
+	done = 0;
+	for (i = 0; i < npages && done < len; i += n) {
+		n = MIN(chunk, npages - i);
+		want = MIN(ptoa(n), len - done);
+		cnt = want;
+		if (pa != NULL) {
+			for (j = 0; j < n; j++)
+				pa[j] = VM_PAGE_TO_PHYS(ma[i + j]);
+			if (write)
+				error = sfprov_write_pages(np->sf_file,
+				    off + done, &cnt, 0, n, pa);
+			else
+				error = sfprov_read_pages(np->sf_file,
+				    off + done, &cnt, 0, n, pa);
+		} else {
+			ib = vboxfs_iobuf_get(vboxfsmp, ptoa(n));
+			if (write) {
+				for (j = 0; j < n; j++) {
+					sf = sf_buf_alloc(ma[i + j], 0);
+					bcopy((void *)sf_buf_kva(sf),
+					    (char *)ib->ib_data + ptoa(j),
+					    PAGE_SIZE);
+					sf_buf_free(sf);
+				}
+				error = sfprov_write(np->sf_file, ib->ib_data,
+				    off + done, &cnt, 1);
+			} else {
+				error = sfprov_read(np->sf_file, ib->ib_data,
+				    off + done, &cnt, 1);
+				for (j = 0; error == 0 && ptoa(j) < cnt; j++) {
+					sf = sf_buf_alloc(ma[i + j], 0);
+					bcopy((char *)ib->ib_data + ptoa(j),
+					    (void *)sf_buf_kva(sf),
+					    MIN(PAGE_SIZE, cnt - ptoa(j)));
+					sf_buf_free(sf);
+				}
+			}
+			vboxfs_iobuf_put(vboxfsmp, ib);
+		}
 		if (error != 0)
 			break;
-		done = bytes;
-		error = sfprov_write(np->sf_file, tmpbuf,
-		    offset, &done, 0);
-		if (error != 0)
+		done += cnt;
+		if (cnt < want)
 			break;
-		total -= done;
-		if (done != bytes)
-			uio->uio_resid += bytes - done;
-	} while (error == 0 && uio->uio_resid > 0 && done > 0);
+	}
+	free(pa, M_VBOXVFS);
+	*donep = done;
+	return (error);
+}
 
-	contigfree(tmpbuf, PAGE_SIZE, M_DEVBUF);
+/*
+ * Page in for mmap and exec, in the manner of NFS: the whole run of pages
+ * the VM asks for is read from the host at once, straight into the pages
+ * where the host takes page lists.  Pages past the end of the file stay
+ * invalid and are zeroed by the VM.
+ */
+static int
+vboxfs_getpages(struct vop_getpages_args *ap)
+{
+	struct vnode *vp = ap->a_vp;
+	struct vboxfs_node *np = VP_TO_VBOXFS_NODE(vp);
+	vm_page_t *pages = ap->a_m;
+	vm_object_t object = vp->v_object;
+	vm_page_t m;
+	size_t size;
+	off_t toff, nextoff;
+	int error, i, npages;
+
+	npages = btoc(ap->a_count);
+	if (object == NULL)
+		return (VM_PAGER_ERROR);
 
-	/* a partial write is never an error */
-	if (total != uio->uio_resid)
-		error = 0;
+	/*
+	 * If the requested page is partially valid, just return it and
+	 * free the others.
+	 */
+	VM_OBJECT_WLOCK(object);
+	if (pages[ap->a_reqpage]->valid != 0) {
+		for (i = 0; i < npages; i++) {
+			if (i != ap->a_reqpage) {
+				vm_page_lock(pages[i]);
+				vm_page_free(pages[i]);
+				vm_page_unlock(pages[i]);
+			}
+		}
+		VM_OBJECT_WUNLOCK(object);
+		return (VM_PAGER_OK);
+	}
+	VM_OBJECT_WUNLOCK(object);
+
+	PCPU_INC(cnt.v_vnodein);
+	PCPU_ADD(cnt.v_vnodepgsin, npages);
+
+	error = vsfnode_page_io(np, pages, npages,
+	    IDX_TO_OFF(pages[0]->pindex), ptoa(npages), 0, &size);
+	if (error != 0 && size == 0) {
+		VM_OBJECT_WLOCK(object);
+		for (i = 0; i < npages; i++) {
+			if (i != ap->a_reqpage) {
+				vm_page_lock(pages[i]);
+				vm_page_free(pages[i]);
+				vm_page_unlock(pages[i]);
+			}
+		}
+		VM_OBJECT_WUNLOCK(object);
+		return (VM_PAGER_ERROR);
+	}
 
-	return (error);
+	/* Validate only what was read. */
+	VM_OBJECT_WLOCK(object);
+	for (i = 0, toff = 0; i < npages; i++, toff = nextoff) {
+		nextoff = toff + PAGE_SIZE;
+		m = pages[i];
+		if (nextoff <= size) {
+			m->valid = VM_PAGE_BITS_ALL;
+			KASSERT(m->dirty == 0,
+			    ("vboxfs_getpages: page %p is dirty", m));
+		} else if (size > toff) {
+			m->valid = 0;
+			vm_page_set_valid_range(m, 0, size - toff);
+			KASSERT(m->dirty == 0,
+			    ("vboxfs_getpages: page %p is dirty", m));
+		}
+		if (i != ap->a_reqpage)
+			vm_page_readahead_finish(m);
+	}
+	VM_OBJECT_WUNLOCK(object);
+	return (VM_PAGER_OK);
+}
+
+/*
+ * Page out dirty mmap'ed pages, never past the end of the file, in one
+ * host transfer per cluster.  Like vboxfs_write() this changes the host
+ * mtime and size on our own account.
+ */
+static int
+vboxfs_putpages(struct vop_putpages_args *ap)
+{
+	struct vnode *vp = ap->a_vp;
+	struct vboxfs_node *np = VP_TO_VBOXFS_NODE(vp);
+	vm_page_t *pages = ap->a_m;
+	int *rtvals = ap->a_rtvals;
+	vm_object_t object = vp->v_object;
+	off_t offset, count;
+	size_t done;
+	int i, npages;
+
+	npages = btoc(ap->a_count);
+	for (i = 0; i < npages; i++)
+		rtvals[i] = VM_PAGER_ERROR;
+	if (object == NULL)
+		return (VM_PAGER_ERROR);
+
+	offset = IDX_TO_OFF(pages[0]->pindex);
+	count = ap->a_count;
+	VM_OBJECT_RLOCK(object);
+	if (offset + count > object->un_pager.vnp.vnp_size)
+		count = MAX(object->un_pager.vnp.vnp_size - offset, 0);
+	VM_OBJECT_RUNLOCK(object);
+
+	PCPU_INC(cnt.v_vnodeout);
+	PCPU_ADD(cnt.v_vnodepgsout, npages);
+
+	/* Pages the host did not take stay dirty. */
+	(void) vsfnode_page_io(np, pages, npages, offset, count, 1, &done);
+	if (done > 0)
+		vsfnode_host_wrote(np);
+	vnode_pager_undirty_pages(pages, rtvals, done);
+	return (rtvals[0]);
 }
 
 static int
@@ -742,7 +2362,7 @@ vboxfs_create(struct vop_create_args *ap)
 	struct componentname *cnp = ap->a_cnp;
 	struct vattr *vap = ap->a_vap;
 	sffs_stat_t	stat;
-	char	*fullpath = NULL;
+	SHFLSTRING *fullpath = NULL;
 	struct vboxfs_node *dir = VP_TO_VBOXFS_NODE(dvp);
 	sfp_file_t *fp;
 	int error;
@@ -750,21 +2370,29 @@ vboxfs_create(struct vop_create_args *ap)
 
 	MPASS(vap->va_type == VREG);
 
-	fullpath = sfnode_construct_path(dir, cnp->cn_nameptr, cnp->cn_namelen);
+	error = sfnode_construct_path(dir, cnp->cn_nameptr, cnp->cn_namelen,
+	    &fullpath);
+	if (error)
+		goto out;
 	error = sfprov_create(dir->vboxfsmp->sf_handle, fullpath, vap->va_mode,
 	    &fp, &stat);
 
 	if (error)
 		goto out;
 
-	error = vboxfs_alloc_file(vboxfsmp, fullpath, VREG, vap->va_mode, dir, cnp->cn_lkflags, vpp);
+	error = vboxfs_alloc_file(vboxfsmp, fullpath->String.utf8, VREG, vap->va_mode, dir, cnp->cn_lkflags, vpp);
+	if (error == 0)
+		vsfnode_attach_file(VP_TO_VBOXFS_NODE(*vpp), fp, &stat);
+	else
+		(void) sfprov_close(fp);
 
 out:
 	if (fullpath)
-		free(fullpath, M_VBOXVFS);
+		sfprov_path_put(fullpath);
 
 	if (error == 0) {
 		vfsnode_clear_dir_list(dir);
+		cache_purge_negative(dvp);
 		if ((cnp->cn_flags & MAKEENTRY) != 0)
 			cache_enter(dvp, *vpp, cnp);
 	}
@@ -787,7 +2415,7 @@ vboxfs_remove(struct vop_remove_args *ap)
 	error = 0;
 
 	np = VP_TO_VBOXFS_NODE(vp);
-	dir = VP_TO_VBOXFS_NODE(vp);
+	dir = VP_TO_VBOXFS_NODE(dvp);
 
 	/*
 	 * If anything else is using this vnode, then fail the remove.
@@ -805,13 +2433,11 @@ vboxfs_remove(struct vop_remove_args *ap)
 		np->sf_file = NULL;
 	}
 
-	error = sfprov_remove(np->vboxfsmp->sf_handle, np->sf_path,
+	error = sfprov_remove(np->vboxfsmp->sf_handle, np->sf_spath,
 	    np->sf_type == VLNK);
 
-#if 0
 	if (error == ENOENT || error == 0)
-		sfnode_make_stale(np);
-#endif
+		vboxfs_node_unhash(np->vboxfsmp, np);
 
 	if (error == 0)
 		vfsnode_clear_dir_list(dir);
@@ -840,27 +2466,32 @@ vboxfs_symlink(struct vop_symlink_args *ap)
 	struct componentname *cnp = ap->a_cnp;
 	struct vattr *vap = ap->a_vap;
 	sffs_stat_t	stat;
-	char	*fullpath = NULL;
+	SHFLSTRING *fullpath = NULL;
 	struct vboxfs_node *dir = VP_TO_VBOXFS_NODE(dvp);
 	int error;
 	struct 	vboxfs_mnt *vboxfsmp = dir->vboxfsmp;
 
 	MPASS(vap->va_type == VLNK);
 
-	fullpath = sfnode_construct_path(dir, cnp->cn_nameptr, cnp->cn_namelen);
+	error = sfnode_construct_path(dir, cnp->cn_nameptr, cnp->cn_namelen,
+	    &fullpath);
+	if (error)
+		goto out;
 	error = sfprov_symlink(dir->vboxfsmp->sf_handle, fullpath, ap->a_target, &stat);
 
 	if (error)
 		goto out;
 
-	error = vboxfs_alloc_file(vboxfsmp, fullpath, VLNK, vap->va_mode, dir, cnp->cn_lkflags, vpp);
+	error = vboxfs_alloc_file(vboxfsmp, fullpath->String.utf8, VLNK, vap->va_mode, dir, cnp->cn_lkflags, vpp);
 
 out:
 	if (fullpath)
-		free(fullpath, M_VBOXVFS);
+		sfprov_path_put(fullpath);
 
-	if (error == 0)
+	if (error == 0) {
 		vfsnode_clear_dir_list(dir);
+		cache_purge_negative(dvp);
+	}
 
 	return (error);
 }
@@ -873,7 +2504,7 @@ vboxfs_mkdir(struct vop_mkdir_args *ap)
 	struct componentname *cnp = ap->a_cnp;
 	struct vattr *vap = ap->a_vap;
 	sffs_stat_t	stat;
-	char	*fullpath = NULL;
+	SHFLSTRING *fullpath = NULL;
 	struct vboxfs_node *dir = VP_TO_VBOXFS_NODE(dvp);
 	sfp_file_t *fp;
 	int error;
@@ -881,21 +2512,30 @@ vboxfs_mkdir(struct vop_mkdir_args *ap)
 
 	MPASS(vap->va_type == VDIR);
 
-	fullpath = sfnode_construct_path(dir, cnp->cn_nameptr, cnp->cn_namelen);
+	error = sfnode_construct_path(dir, cnp->cn_nameptr, cnp->cn_namelen,
+	    &fullpath);
+	if (error)
+		goto out;
 	error = sfprov_mkdir(dir->vboxfsmp->sf_handle, fullpath, vap->va_mode,
 	    &fp, &stat);
 
 	if (error)
 		goto out;
 
-	error = vboxfs_alloc_file(vboxfsmp, fullpath, VDIR, vap->va_mode, dir, cnp->cn_lkflags, vpp);
+	error = vboxfs_alloc_file(vboxfsmp, fullpath->String.utf8, VDIR, vap->va_mode, dir, cnp->cn_lkflags, vpp);
+	if (error == 0)
+		vsfnode_attach_file(VP_TO_VBOXFS_NODE(*vpp), fp, &stat);
+	else
+		(void) sfprov_close(fp);
 
 out:
 	if (fullpath)
-		free(fullpath, M_VBOXVFS);
+		sfprov_path_put(fullpath);
 
-	if (error == 0)
+	if (error == 0) {
 		vfsnode_clear_dir_list(dir);
+		cache_purge_negative(dvp);
+	}
 
 	return (error);
 }
@@ -915,7 +2555,7 @@ vboxfs_rmdir(struct vop_rmdir_args *ap)
 	error = 0;
 
 	np = VP_TO_VBOXFS_NODE(vp);
-	dir = VP_TO_VBOXFS_NODE(vp);
+	dir = VP_TO_VBOXFS_NODE(dvp);
 
 	/*
 	 * If anything else is using this vnode, then fail the remove.
@@ -929,16 +2569,15 @@ vboxfs_rmdir(struct vop_rmdir_args *ap)
 			error = ETXTBSY;
 			goto out;
 		}
+		vfsnode_clear_dir_list(np);
 		sfprov_close(np->sf_file);
 		np->sf_file = NULL;
 	}
 
-	error = sfprov_rmdir(np->vboxfsmp->sf_handle, np->sf_path);
+	error = sfprov_rmdir(np->vboxfsmp->sf_handle, np->sf_spath);
 
-#if 0
 	if (error == ENOENT || error == 0)
-		sfnode_make_stale(np);
-#endif
+		vboxfs_node_unhash(np->vboxfsmp, np);
 
 	if (error == 0)
 		vfsnode_clear_dir_list(dir);
@@ -954,11 +2593,12 @@ vboxfs_readdir(struct vop_readdir_args *ap)
 	struct vnode *vp = ap->a_vp;
 	struct uio *uio = ap->a_uio;
 	struct vboxfs_node *dir = VP_TO_VBOXFS_NODE(vp);
-	struct vboxfs_node *node;
-	struct sffs_dirent *dirent = NULL;
+	struct dirent *dirent = NULL;
 	sffs_dirents_t *cur_buf;
 	off_t offset = 0;
+	off_t len;
 	off_t orig_off = uio->uio_offset;
+	u_int idx;
 	int error = 0;
 	int dummy_eof;
 
@@ -969,107 +2609,268 @@ vboxfs_readdir(struct vop_readdir_args *ap)
 		eofp = &dummy_eof;
 	*eofp = 0;
 
+	if (uio->uio_offset < 0)
+		return (EINVAL);
+
 	/*
-	 * Get the directory entry names from the host. This gets all
-	 * entries. These are stored in a linked list of sffs_dirents_t
-	 * buffers, each of which contains a list of dirent64_t's.
+	 * Get the directory entry names from the host. These are stored
+	 * in a linked list of sffs_dirents_t buffers, each of which
+	 * contains a list of dirent64_t's.  The host is asked for more
+	 * entries only as the reader gets to them, and the stream stays
+	 * open on the node between calls.  A reader going back to before
+	 * what is still held (the front of a huge listing is dropped as
+	 * the reader moves on) starts over from the host.  The listing
+	 * outlives close; a reader starting over at offset 0 reuses it
+	 * unless the directory changed on the host.
 	 */
-	if (dir->sf_dir_list == NULL) {
-		error = sfprov_readdir(dir->vboxfsmp->sf_handle, dir->sf_path,
-		    &dir->sf_dir_list);
+	sx_xlock(&dir->sf_dir_lock);
+	if ((uio->uio_offset == 0 && !vsfnode_dir_valid(dir)) ||
+	    uio->uio_offset / SFFS_DIRENTS_SIZE < dir->sf_dir_first)
+		vfsnode_clear_dir_list_locked(dir);
+	if (dir->sf_dir_time == 0) {
+		error = vsfnode_dir_start(dir, dir->sf_file, uio->uio_offset);
 		if (error != 0)
 			goto done;
 	}
 
 	/*
-	 * Validate and skip to the desired offset.
+	 * Validate and skip to the desired offset.  Offsets past the end
+	 * of the listing just read as end of directory.
 	 */
-	cur_buf = dir->sf_dir_list;
-	offset = 0;
-
-	while (cur_buf != NULL && offset + cur_buf->sf_len <= uio->uio_offset) {
-		offset += cur_buf->sf_len;
-		cur_buf = cur_buf->sf_next;
-	}
+	error = vsfnode_dir_seek(dir, uio->uio_offset, &cur_buf, &idx,
+	    &offset);
+	if (error != 0)
+		goto done;
 
-	if (cur_buf == NULL && offset != uio->uio_offset) {
+	if (cur_buf != NULL && offset < cur_buf->sf_len &&
+	    (offset % sizeof(uint64_t) != 0 ||
+	    isclr(cur_buf->sf_recmap, offset / sizeof(uint64_t)))) {
 		error = EINVAL;
 		goto done;
 	}
-
-	if (cur_buf != NULL && offset != uio->uio_offset) {
-		off_t off = offset;
-		int step;
-		dirent = &cur_buf->sf_entries[0];
-
-		while (off < uio->uio_offset) {
-			if (dirent->sf_off == uio->uio_offset)
-				break;
-			step = sizeof(struct sffs_dirent) + dirent->sf_entry.d_reclen;
-			dirent = (struct sffs_dirent *) (((char *) dirent) + step);
-			off += step;
-		}
-
-		if (off >= uio->uio_offset) {
-			error = EINVAL;
-			goto done;
-		}
+	if (cur_buf != NULL && offset > cur_buf->sf_len) {
+		error = EINVAL;
+		goto done;
 	}
 
-	offset = uio->uio_offset - offset;
-
 	/*
-	 * Lookup each of the names, so that we have ino's, and copy to
-	 * result buffer.
+	 * Copy the entries to the result buffer.
 	 */
 	while (cur_buf != NULL) {
 		if (offset >= cur_buf->sf_len) {
-			cur_buf = cur_buf->sf_next;
-			offset = 0;
+			/* Go on at the start of the next buffer. */
+			uio->uio_offset = (off_t)(idx + 1) * SFFS_DIRENTS_SIZE;
+			error = vsfnode_dir_seek(dir, uio->uio_offset,
+			    &cur_buf, &idx, &offset);
+			if (error != 0)
+				break;
 			continue;
 		}
 
-		dirent = (struct sffs_dirent *)
-		    (((char *) &cur_buf->sf_entries[0]) + offset);
-		if (dirent->sf_entry.d_reclen > uio->uio_resid)
-			break;
-
-		if (strcmp(dirent->sf_entry.d_name, ".") == 0) {
-			node = dir;
-		} else if (strcmp(dirent->sf_entry.d_name, "..") == 0) {
-			node = dir->sf_parent;
-			if (node == NULL)
-				node = dir;
-		} else {
-#if 0
-			node = vsfnode_lookup(dir, dirent->sf_entry.d_name, VNON,
-			    0, &dirent->sf_stat, vsfnode_cur_time_usec(), NULL);
-			if (node == NULL)
-				panic("sffs_readdir() lookup failed");
-#endif
+		/*
+		 * The records are stored ready to copy, so hand out as many
+		 * whole ones as fit with one uiomove() per buffer.
+		 */
+		dirent = (struct dirent *)(&cur_buf->sf_entries[0] + offset);
+		len = 0;
+		while (offset + len < cur_buf->sf_len &&
+		    len + dirent->d_reclen <= uio->uio_resid) {
+			len += dirent->d_reclen;
+			dirent = (struct dirent *)
+			    ((char *)dirent + dirent->d_reclen);
 		}
+		if (len == 0)
+			break;
 
-		if (node)
-			dirent->sf_entry.d_fileno = node->sf_ino;
-		else
-			dirent->sf_entry.d_fileno = 0xdeadbeef;
-
-		error = uiomove(&dirent->sf_entry, dirent->sf_entry.d_reclen, uio);
+		/* uiomove() advances uio_offset to the next record. */
+		error = uiomove(&cur_buf->sf_entries[0] + offset, len, uio);
 		if (error != 0)
 			break;
 
-		uio->uio_offset = dirent->sf_off;
-		offset += sizeof(struct sffs_dirent) + dirent->sf_entry.d_reclen;
+		offset += len;
 	}
 
 	if (error == 0 && cur_buf == NULL)
 		*eofp = 1;
 done:
+	sx_xunlock(&dir->sf_dir_lock);
 	if (error != 0)
 		uio->uio_offset = orig_off;
 	return (error);
 }
 
+/*
+ * Background prefetch.  With the prefetch mount option a kernel thread
+ * lists the share breadth first right after the mount, down to
+ * sf_prefetch_depth levels and at most sf_prefetch_max directories, at
+ * the lowest time-sharing priority.  It lists with the directory's
+ * sf_dir_lock held, and sx locks lend no priority: at idle priority a
+ * busy guest would never run it, and lookups and readdirs of that
+ * directory would wait behind it for good.  Each directory it lists gets a node, which the thread
+ * keeps referenced until unmount, so the listing, its name index and the
+ * attributes it carries are there when the first lookup or readdir
+ * comes.  The listings still go stale and are dropped under memory
+ * pressure as any other.
+ */
+
+/*
+ * Complete the directory's listing, unless a valid one is already held.
+ */
+static int
+vsfnode_dir_prefetch(struct vboxfs_node *dir)
+{
+	int error;
+
+	sx_assert(&dir->sf_dir_lock, SA_XLOCKED);
+	error = 0;
+	if (dir->sf_dir_stream == NULL && !vsfnode_dir_valid(dir))
+		vfsnode_clear_dir_list_locked(dir);
+	/* The thread has no open handle of its own to list with. */
+	if (dir->sf_dir_time == 0)
+		error = vsfnode_dir_start(dir, NULL, 0);
+	while (error == 0 && dir->sf_dir_stream != NULL)
+		error = vsfnode_dir_fetch(dir, 0);
+	if (error != 0)
+		vfsnode_clear_dir_list_locked(dir);
+	return (error);
+}
+
+/*
+ * Queue the subdirectories of 'dir', from its listing, after the
+ * directories already in sf_prefetch_nodes.
+ */
+static void
+vsfnode_dir_prefetch_children(struct vboxfs_node *dir)
+{
+	struct vboxfs_mnt *vboxfsmp = dir->vboxfsmp;
+	sffs_dirents_t *cur_buf;
+	struct dirent *dirent;
+	struct vboxfs_node *np;
+	SHFLSTRING *path;
+	int error, i;
+
+	sx_assert(&dir->sf_dir_lock, SA_XLOCKED);
+	for (cur_buf = dir->sf_dir_list; cur_buf != NULL;
+	    cur_buf = cur_buf->sf_next) {
+		dirent = (struct dirent *)&cur_buf->sf_entries[0];
+		for (i = 0; i < cur_buf->sf_nents; i++,
+		    dirent = (struct dirent *)
+		    ((char *)dirent + dirent->d_reclen)) {
+			if (vboxfsmp->sf_prefetch_nnodes >=
+			    vboxfsmp->sf_prefetch_max ||
+			    vboxfsmp->sf_prefetch_stop)
+				return;
+			if (dirent->d_type != DT_DIR ||
+			    strcmp(dirent->d_name, ".") == 0 ||
+			    strcmp(dirent->d_name, "..") == 0)
+				continue;
+			error = sfnode_construct_path(dir, dirent->d_name,
+			    dirent->d_namlen, &path);
+			if (error != 0)
+				continue;
+			error = vboxfs_get_node(vboxfsmp, path->String.utf8,
+			    VDIR, 0755, dir, &np);
+			sfprov_path_put(path);
+			if (error != 0)
+				return;
+			vsfnode_seed_stat(np, SFFS_DIRENTS_STAT(cur_buf, i),
+			    dir->sf_dir_time);
+			vboxfsmp->sf_prefetch_nodes[
+			    vboxfsmp->sf_prefetch_nnodes++] = np;
+		}
+	}
+}
+
+static void
+vboxfs_prefetch(void *arg)
+{
+	struct vboxfs_mnt *vboxfsmp = arg;
+	struct thread *td = curthread;
+	struct vboxfs_node *dir;
+	u_int i, levelend;
+	int depth;
+
+	thread_lock(td);
+	sched_prio(td, PRI_MAX_TIMESHARE);
+	thread_unlock(td);
+
+	vboxfs_node_hold(vboxfsmp->sf_root);
+	vboxfsmp->sf_prefetch_nodes[0] = vboxfsmp->sf_root;
+	vboxfsmp->sf_prefetch_nnodes = 1;
+	depth = 0;
+	levelend = 1;
+	for (i = 0; i < vboxfsmp->sf_prefetch_nnodes &&
+	    !vboxfsmp->sf_prefetch_stop; i++) {
+		if (i == levelend) {
+			depth++;
+			levelend = vboxfsmp->sf_prefetch_nnodes;
+		}
+		dir = vboxfsmp->sf_prefetch_nodes[i];
+		sx_xlock(&dir->sf_dir_lock);
+		if (vsfnode_dir_prefetch(dir) == 0) {
+			counter_u64_add(vboxfs_prefetch_dirs, 1);
+			if (depth + 1 < vboxfsmp->sf_prefetch_depth)
+				vsfnode_dir_prefetch_children(dir);
+		}
+		sx_xunlock(&dir->sf_dir_lock);
+	}
+
+	mtx_lock(&vboxfsmp->sf_prefetch_lock);
+	vboxfsmp->sf_prefetch_running = 0;
+	wakeup(&vboxfsmp->sf_prefetch_running);
+	mtx_unlock(&vboxfsmp->sf_prefetch_lock);
+	kthread_exit();
+}
+
+/*
+ * Start the prefetch thread of a new mount, if it has one.
+ */
+void
+vboxfs_prefetch_start(struct vboxfs_mnt *vboxfsmp)
+{
+	int error;
+
+	mtx_init(&vboxfsmp->sf_prefetch_lock, "vboxfs prefetch", NULL,
+	    MTX_DEF);
+	if (vboxfsmp->sf_prefetch_depth <= 0 || vboxfsmp->sf_prefetch_max == 0)
+		return;
+	vboxfsmp->sf_prefetch_nodes = malloc(vboxfsmp->sf_prefetch_max *
+	    sizeof(*vboxfsmp->sf_prefetch_nodes), M_VBOXVFS, M_WAITOK);
+	vboxfsmp->sf_prefetch_running = 1;
+	error = kthread_add(vboxfs_prefetch, vboxfsmp, NULL, NULL, 0, 0,
+	    "vboxfs prefetch");
+	if (error != 0) {
+		printf("vboxvfs: cannot start prefetch thread: error %d\n",
+		    error);
+		vboxfsmp->sf_prefetch_running = 0;
+	}
+}
+
+/*
+ * Stop the prefetch thread, waiting for it to finish the directory it
+ * is listing, and drop the nodes it holds.
+ */
+void
+vboxfs_prefetch_stop(struct vboxfs_mnt *vboxfsmp)
+{
+	u_int i;
+
+	mtx_lock(&vboxfsmp->sf_prefetch_lock);
+	vboxfsmp->sf_prefetch_stop = 1;
+	while (vboxfsmp->sf_prefetch_running)
+		msleep(&vboxfsmp->sf_prefetch_running,
+		    &vboxfsmp->sf_prefetch_lock, PVFS, "vsfpfs", 0);
+	mtx_unlock(&vboxfsmp->sf_prefetch_lock);
+	mtx_destroy(&vboxfsmp->sf_prefetch_lock);
+
+	for (i = 0; i < vboxfsmp->sf_prefetch_nnodes; i++)
+		vboxfs_node_rele(vboxfsmp, vboxfsmp->sf_prefetch_nodes[i]);
+	if (vboxfsmp->sf_prefetch_nodes != NULL)
+		free(vboxfsmp->sf_prefetch_nodes, M_VBOXVFS);
+	vboxfsmp->sf_prefetch_nodes = NULL;
+	vboxfsmp->sf_prefetch_nnodes = 0;
+}
+
 static int
 vboxfs_readlink(struct vop_readlink_args *v)
 {
@@ -1078,34 +2879,47 @@ vboxfs_readlink(struct vop_readlink_args *v)
 
 	int error;
 	struct vboxfs_node *np;
-	void *tmpbuf;
+	struct vboxfs_iobuf *ib;
 
 	MPASS(uio->uio_offset == 0);
 	MPASS(vp->v_type == VLNK);
 
 	np = VP_TO_VBOXFS_NODE(vp);
 
-	tmpbuf = contigmalloc(MAXPATHLEN, M_DEVBUF, M_WAITOK, 0, ~0, 1, 0);
-	if (tmpbuf == NULL)
-		return (ENOMEM);
+	ib = vboxfs_iobuf_get(np->vboxfsmp, MAXPATHLEN);
 
-	error = sfprov_readlink(np->vboxfsmp->sf_handle, np->sf_path, tmpbuf,
-	    MAXPATHLEN);
+	error = sfprov_readlink(np->vboxfsmp->sf_handle, np->sf_spath,
+	    ib->ib_data, MAXPATHLEN);
 	if (error)
 		goto done;
 
-	error = uiomove(tmpbuf, strlen(tmpbuf), uio);
+	error = uiomove(ib->ib_data, strnlen(ib->ib_data, MAXPATHLEN), uio);
 
 done:
-	if (tmpbuf)
-		contigfree(tmpbuf, MAXPATHLEN, M_DEVBUF);
+	vboxfs_iobuf_put(np->vboxfsmp, ib);
 	return (error);
 }
 
+/*
+ * Send buffered writes to the host and, unless the mount says nofsync,
+ * have the host flush the file to its disk.  The syncer comes here with
+ * MNT_LAZY and only the first part is done.  fdatasync(2) comes here
+ * too, through vop_stdfdatasync(): the host has no data-only flush.
+ */
 static int
 vboxfs_fsync(struct vop_fsync_args *ap)
 {
-	return (EOPNOTSUPP);
+	struct vnode *vp = ap->a_vp;
+	struct vboxfs_node *np = VP_TO_VBOXFS_NODE(vp);
+	int error;
+
+	error = vsfnode_flush(vp, ap->a_waitfor, ap->a_td);
+	if (error != 0 || ap->a_waitfor != MNT_WAIT)
+		return (error);
+	if (vp->v_type != VREG || !np->vboxfsmp->sf_fsync ||
+	    np->sf_file == NULL)
+		return (0);
+	return (vsfnode_host_sync(np));
 }
 
 static int
@@ -1159,6 +2973,35 @@ vboxfs_ioctl(struct vop_ioctl_args *ap)
 	return (ENOTTY);
 }
 
+/*
+ * Whether live node np, found in the hash under 'name' in directory dir,
+ * still stands for that name.  On an immutable mount its index entry is
+ * looked up again: a directory listed anew since the node was made has
+ * its children in new entries, and the old one would never change.
+ */
+static int
+vsfnode_live_current(struct vboxfs_node *dir, struct vboxfs_node *np,
+    const char *name, int namelen)
+{
+	struct vboxfs_mnt *vboxfsmp = np->vboxfsmp;
+	sffs_stat_t stat;
+	uint32_t ient;
+
+	if (vboxfsmp->sf_index != NULL) {
+		if (vboxfs_index_lookup(vboxfsmp->sf_index, dir->sf_ient, name,
+		    namelen, &ient, &stat) != 0)
+			return (0);
+		VBOXFS_NODE_LOCK(np);
+		np->sf_ient = ient;
+		np->sf_stat = stat;
+		np->sf_stat_time = vsfnode_cur_time_usec();
+		VBOXFS_NODE_UNLOCK(np);
+	} else if (!vsfnode_stat_cached(np) &&
+	    vsfnode_update_stat_cache(np) != 0)
+		return (0);
+	return (IFTOVT(np->sf_stat.sf_mode) == np->sf_type);
+}
+
 /*
  * Lookup an entry in a directory and create a new vnode if found.
  */
@@ -1176,21 +3019,24 @@ vboxfs_lookup(struct vop_cachedlookup_args /* {
 	struct	vnode **vpp = ap->a_vpp;	/* the vnode we found or NULL */
 	struct  vnode *tdp = NULL;
 	struct 	vboxfs_node *node = VP_TO_VBOXFS_NODE(dvp);
+	struct 	vboxfs_node *np;
 	struct 	vboxfs_mnt *vboxfsmp = node->vboxfsmp;
 	u_long  nameiop = cnp->cn_nameiop;
 	u_long 	flags = cnp->cn_flags;
 	sffs_stat_t	stat;
+	uint64_t	stat_time;
+	struct timespec	ts;
 	//long 	namelen;
 	ino_t 	id = 0;
-	int 	ltype, type, error = 0;
+	int 	ltype, type, found, error = 0;
+	uint32_t	ient;
 	int 	lkflags = cnp->cn_lkflags;
-	char	*fullpath = NULL;
+	SHFLSTRING *fullpath = NULL;
 
 	error = ENOENT;
 	if (cnp->cn_flags & ISDOTDOT) {
 		error = vn_vget_ino_gen(dvp, vboxfs_vn_get_ino_alloc,
 		    node->sf_parent, cnp->cn_lkflags, vpp);
-		error = ENOENT;
 		if (error != 0)
 			goto out;
 
@@ -1198,13 +3044,50 @@ vboxfs_lookup(struct vop_cachedlookup_args /* {
 		VREF(dvp);
 		*vpp = dvp;
 		error = 0;
+	} else if ((np = vboxfs_node_lookup(vboxfsmp, node, cnp->cn_nameptr,
+	    cnp->cn_namelen)) != NULL &&
+	    vsfnode_live_current(node, np, cnp->cn_nameptr, cnp->cn_namelen)) {
+		/* Reuse the live node, along with its vnode and caches. */
+		error = vboxfs_alloc_vp(vboxfsmp->sf_vfsp, np, lkflags, vpp);
+		vboxfs_node_rele(vboxfsmp, np);
 	} else {
 		mode_t m;
+
+		if (np != NULL) {
+			/* The node no longer matches the host; forget it. */
+			vboxfs_node_unhash(vboxfsmp, np);
+			vboxfs_node_rele(vboxfsmp, np);
+		}
 		type = VNON;
-		fullpath = sfnode_construct_path(node, cnp->cn_nameptr, cnp->cn_namelen);
-		error = sfprov_get_attr(node->vboxfsmp->sf_handle,
-		    fullpath, &stat);
-		// stat_time = vsfnode_cur_time_usec();
+		if (vboxfsmp->sf_index != NULL) {
+			/* Immutable: the index has the only answer. */
+			error = vboxfs_index_lookup(vboxfsmp->sf_index,
+			    node->sf_ient, cnp->cn_nameptr, cnp->cn_namelen,
+			    &ient, &stat);
+			stat_time = vsfnode_cur_time_usec();
+			/* A directory the host would not list, say. */
+			if (error != 0 && error != ENOENT)
+				goto out;
+		} else {
+			error = vsfnode_dir_lookup(node, cnp->cn_nameptr,
+			    cnp->cn_namelen, &stat, &stat_time);
+			if (error != 0 && error != ENOENT &&
+			    error != EJUSTRETURN)
+				goto out;
+		}
+		if (error != ENOENT) {
+			found = error;
+			error = sfnode_construct_path(node, cnp->cn_nameptr,
+			    cnp->cn_namelen, &fullpath);
+			if (error != 0)
+				goto out;
+			if (found == EJUSTRETURN) {
+				stat_time = vsfnode_cur_time_usec();
+				error = sfprov_get_attr(
+				    node->vboxfsmp->sf_handle, fullpath,
+				    &stat);
+			}
+		}
 
 		m = stat.sf_mode;
 		if (error != 0) {
@@ -1238,23 +3121,99 @@ vboxfs_lookup(struct vop_cachedlookup_args /* {
 				type = VREG;
 			else if (S_ISLNK(m))
 				type = VLNK;
-			error = vboxfs_alloc_file(vboxfsmp, fullpath, type, 0755, node, cnp->cn_lkflags, vpp);
+			error = vboxfs_alloc_file(vboxfsmp, fullpath->String.utf8, type, 0755, node, cnp->cn_lkflags, vpp);
+			if (error == 0 && vboxfsmp->sf_index != NULL) {
+				np = VP_TO_VBOXFS_NODE(*vpp);
+				np->sf_ient = ient;
+				np->sf_stat = stat;
+				np->sf_stat_time = stat_time;
+			} else if (error == 0 && !vsfnode_stat_cached(
+			    VP_TO_VBOXFS_NODE(*vpp))) {
+				np = VP_TO_VBOXFS_NODE(*vpp);
+				np->sf_stat = stat;
+				np->sf_stat_time = stat_time;
+			}
 		}
 	}
 
-	if ((cnp->cn_flags & MAKEENTRY) != 0)
-		cache_enter(dvp, *vpp, cnp);
+	if ((cnp->cn_flags & MAKEENTRY) != 0) {
+		if (error == 0)
+			cache_enter(dvp, *vpp, cnp);
+		else if (error == ENOENT && (vboxfsmp->sf_neg_ttl != 0 ||
+		    vboxfsmp->sf_index != NULL)) {
+			/* The time only marks this as a timed entry. */
+			vfs_timestamp(&ts);
+			cache_enter_time(dvp, NULL, cnp, &ts, NULL);
+		}
+	}
 out:
 	if (fullpath)
-		free(fullpath, M_VBOXVFS);
+		sfprov_path_put(fullpath);
 
 	return (error);
 }
 
+/*
+ * vfs_cache_lookup() with negative entries that expire.  A name the host
+ * did not have is entered in the name cache with its creation time in
+ * ticks, and is trusted for the mount's negttl.  An older one sends the
+ * lookup back to vboxfs_lookup(), so files created on the host show up;
+ * as in NFS, the directory's other negative entries go with it.
+ */
+static int
+vboxfs_cache_lookup(struct vop_lookup_args *ap)
+{
+	struct vnode *dvp = ap->a_dvp;
+	struct vnode **vpp = ap->a_vpp;
+	struct componentname *cnp = ap->a_cnp;
+	struct vboxfs_mnt *vboxfsmp;
+	struct timespec nctime;
+	int error, ncticks;
+
+	*vpp = NULL;
+	if (dvp->v_type != VDIR)
+		return (ENOTDIR);
+	if ((cnp->cn_flags & ISLASTCN) &&
+	    (dvp->v_mount->mnt_flag & MNT_RDONLY) &&
+	    (cnp->cn_nameiop == DELETE || cnp->cn_nameiop == RENAME))
+		return (EROFS);
+	error = VOP_ACCESS(dvp, VEXEC, cnp->cn_cred, cnp->cn_thread);
+	if (error != 0)
+		return (error);
+
+	error = cache_lookup(dvp, vpp, cnp, &nctime, &ncticks);
+	switch (error) {
+	case -1:
+		return (0);
+	case 0:
+		break;
+	case ENOENT:
+		vboxfsmp = VP_TO_VBOXFS_NODE(dvp)->vboxfsmp;
+		if (vboxfsmp->sf_index != NULL ||
+		    (u_int)(ticks - ncticks) <
+		    (uint64_t)vboxfsmp->sf_neg_ttl * hz / 1000) {
+			counter_u64_add(vboxfs_neg_hits, 1);
+			return (ENOENT);
+		}
+		counter_u64_add(vboxfs_neg_expired, 1);
+		cache_purge_negative(dvp);
+		break;
+	default:
+		return (error);
+	}
+	return (VOP_CACHEDLOOKUP(dvp, vpp, cnp));
+}
+
+/*
+ * A handle attached by create or mkdir that no open took over is closed
+ * here, when the vnode goes unused.
+ */
 static int
 vboxfs_inactive(struct vop_inactive_args *ap)
 {
-   	return (0);
+
+	vsfnode_close_file(VP_TO_VBOXFS_NODE(ap->a_vp));
+	return (0);
 }
 
 static int
@@ -1276,15 +3235,14 @@ vboxfs_reclaim(struct vop_reclaim_args *ap)
 	VBOXFS_ASSERT_ELOCKED(node);
 	vboxfs_free_vp(vp);
 
-	/* If the node referenced by this vnode was deleted by the user,
-	 * we must free its associated data structures (now that the vnode
-	 * is being reclaimed). */
-	if ((node->sf_vpstate & VBOXFS_VNODE_ALLOCATING) == 0) {
-		node->sf_vpstate = VBOXFS_VNODE_DOOMED;
-		VBOXFS_NODE_UNLOCK(node);
-		vboxfs_free_node(vboxfsmp, node);
-	} else
-		VBOXFS_NODE_UNLOCK(node);
+	VBOXFS_NODE_UNLOCK(node);
+
+	/*
+	 * Drop the vnode's reference.  The node stays around while it is
+	 * hashed and referenced elsewhere, so a later lookup can attach a
+	 * new vnode to it.
+	 */
+	vboxfs_node_rele(vboxfsmp, node);
 
 	MPASS(vp->v_data == NULL);
 